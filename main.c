@@ -1,9 +1,42 @@
 #include <stdint.h>
+#include <stddef.h>
 #include <ch32v00x.h>
 
 // IS31FL3731_COMPATIBLE:
-//     this mode uses 8bit reg address, allows pages(but ignores them)
-//     and is compatible with IS31FL3731 register of LED colors.
+//     this mode uses 8bit reg address and pages, and is compatible with
+//     IS31FL3731 register of LED colors, frame pages(IS31_FRAMES of them
+//     fit in RAM), picture/auto play mode, breath and blink.
+//
+// WS2812_PALETTE_BITS=4/8:
+//     pixel buffer stores palette index for every LED instead of colors,
+//     colors are expanded from palette when they are sent to LEDs.
+//     4bit index drives 2048 LEDs with 16 colors, 8bit index drives 1024
+//     LEDs with WS2812_PALETTE_SIZE(default 64) colors.
+//
+// WS2812_BACK_BUFFER:
+//     second frame buffer at register 0xa000, pixel buffer crossfades to
+//     it in fade_ms, WS2812_MAX_LEDS defaults to 256 to fit in RAM.
+//
+// WS2812_TRANSITIONS=16:
+//     table of LEDs fading to their own colors in their own time, fed by
+//     register 0x9000, WS2812_MAX_LEDS defaults to 480 to fit in RAM.
+//
+// WS2812_INTERPOLATE:
+//     back buffer and a third buffer, LEDs move from the last committed
+//     frame to the new one in the time between the two commits, so a low
+//     host frame rate looks smooth. WS2812_MAX_LEDS defaults to 160.
+//
+// CLIP_FLASH_SIZE=4096:
+//     flash reserved for an animation clip of RLE frames, saved from pixel
+//     buffer and played back without host.
+//
+// SCENE_SLOTS=2:
+//     flash slots that keep a copy of pixel buffer, saved and loaded by one
+//     command, slot 0 is shown at power on.
+//
+// USART_BAUD=1000000/2000000:
+//     USART1 RX(PD6) also takes Adalight or TPM2 frames, LED data goes to
+//     pixel buffer by DMA as it is, host sends GRB order(or indexes).
 
 // convert one 8bit to 32bits.
 // 0 code 0.33us/H, 1us/L, 0x08/0b1000
@@ -11,109 +44,1907 @@
 // reset 50us/L, 160bits, 50 bytes of SPI around 120us.
 #define SPI_RESET_COUNT     50
 
+// I2C slave clock, 100000/400000, or 1000000 for Fast-mode Plus.
+#ifndef I2C_CLOCK_SPEED
+#define I2C_CLOCK_SPEED     400000
+#endif
+
+#ifdef WS2812_INTERPOLATE
+#define WS2812_BACK_BUFFER
+#endif
+
+// SysTick runs free at HCLK/8 as time base of main loop.
+#define TICK_HZ             (SystemCoreClock / 8)
+#define TICK_NOW()          (SysTick->CNT)
+
 #ifdef IS31FL3731_COMPATIBLE
 #define I2C_ADDRESS         0x74
 #define WS2812_MAX_LEDS     72
+// frame pages kept in RAM, IS31FL3731 has 8 but RAM only fits 6 frames of
+// 72 LEDs. writes to the other frames are dropped and they show dark.
+#ifndef IS31_FRAMES
+#define IS31_FRAMES         6
+#endif
+// page 0x0b: function registers.
+#define IS31_PAGE_FUNC      0x0b
+// page 0x0c: control registers, same as register 0x8000 of the other mode.
+#define IS31_PAGE_CTRL      0x0c
 volatile static uint8_t i2c_page;
 #else
 #define I2C_ADDRESS         0x74
+#if WS2812_PALETTE_BITS == 4
+#define WS2812_MAX_LEDS     2048
+#define WS2812_PALETTE_SIZE 16
+#elif WS2812_PALETTE_BITS == 8
+#define WS2812_MAX_LEDS     1024
+#ifndef WS2812_PALETTE_SIZE
+#define WS2812_PALETTE_SIZE 64
+#endif
+// color index is masked by size - 1 and fits in a byte.
+#if (WS2812_PALETTE_SIZE & (WS2812_PALETTE_SIZE - 1)) || WS2812_PALETTE_SIZE > 256
+#error "WS2812_PALETTE_SIZE must be a power of 2 up to 256."
+#endif
+#elif defined(WS2812_PALETTE_BITS)
+#error "WS2812_PALETTE_BITS only supports 4 or 8."
+#elif !defined(WS2812_MAX_LEDS) && defined(WS2812_INTERPOLATE)
+#define WS2812_MAX_LEDS     160
+#elif !defined(WS2812_MAX_LEDS) && defined(WS2812_BACK_BUFFER) && \
+      defined(WS2812_TRANSITIONS)
+#define WS2812_MAX_LEDS     224
+#elif !defined(WS2812_MAX_LEDS) && defined(WS2812_BACK_BUFFER)
+#define WS2812_MAX_LEDS     256
+#elif !defined(WS2812_MAX_LEDS) && defined(WS2812_TRANSITIONS)
+#define WS2812_MAX_LEDS     480
+#elif !defined(WS2812_MAX_LEDS)
 #define WS2812_MAX_LEDS     512
 #endif
+// I2C1 RX request is routed to DMA1 channel 7, bulk pixel data goes
+// to pixel buffer directly without an interrupt for every byte.
+#define I2C_RX_DMA          DMA1_Channel7
+// I2C1 TX request is routed to DMA1 channel 6, reads of pixel buffer and
+// control registers are sent the same way.
+#define I2C_TX_DMA          DMA1_Channel6
+#define I2C_DMA_RX          1
+#define I2C_DMA_TX          2
+volatile static uint8_t i2c_dma;
+// register after the last one DMA receives or sends.
+volatile static uint16_t i2c_dma_end;
+
+// register map, 16bit address:
+// 0x0000: pixel buffer, GRB bytes(or palette indexes in palette mode).
+// 0x1000: RGB565 packed colors, 2 bytes per LED, high byte first.
+// 0x2000: RGB444 packed colors, 3 bytes per 2 LEDs, R0G0 B0R1 G1B1.
+// 0x3000: RGB332 packed colors, 1 byte per LED.
+// 0x4000: RLE stream, address offset is the LED index where it starts.
+// 0x5000: sparse update, list of LED index(high byte first) and R, G, B.
+// 0x6000: stream, enter stream mode at pixel buffer offset.
+// 0x7000: palette, GRB bytes for every palette entry.
+// 0x8000: control registers.
+// 0x9000: transition, list of LED index(high byte first), R, G, B and steps.
+// 0xa000: back buffer(WS2812_BACK_BUFFER), GRB bytes of next frame.
+// packed color windows use byte offset of packed data as address offset.
+#define REG_RGB565          0x1000
+#define REG_RGB444          0x2000
+#define REG_RGB332          0x3000
+#define REG_RLE             0x4000
+#define REG_SPARSE          0x5000
+#define REG_STREAM          0x6000
+#define REG_PALETTE         0x7000
+#define REG_CTRL            0x8000
+#define REG_TRANS           0x9000
+#define REG_BACK            0xa000
+#define REG_WINDOW(reg)     ((reg) & 0xf000)
+#endif
+
+#define STATUS_RLE_ERROR    0x01    // RLE stream runs out of pixels or ends in a run.
+#define STATUS_SPARSE_ERROR 0x02    // sparse update has bad index, too many entries or ends in an entry.
+#define STATUS_CMD_ERROR    0x04    // command has bad range or operation.
+#define STATUS_CFG_ERROR    0x08    // config has bad I2C address or color order.
+#define STATUS_TRANS_ERROR  0x10    // transition has bad index, too many entries, ends in an entry or table is full.
+
+// commands run from main loop on LEDs [cmd_start, cmd_start + cmd_count).
+#define CMD_NONE            0
+#define CMD_FILL            1       // set to cmd_color.
+#define CMD_COPY            2       // copy from LEDs start at cmd_arg, may overlap.
+#define CMD_ADD             3       // add cmd_color, saturated.
+#define CMD_SUB             4       // subtract cmd_color, saturated.
+#define CMD_SCALE           5       // multiply by cmd_arg / 256, saturated.
+#define CMD_SHIFT           6       // move by cmd_arg LEDs, fill cmd_color to the gap.
+#define CMD_ROTATE          7       // move by cmd_arg LEDs, wrap around.
+
+// sparse updates are kept until the transfer stops and then applied
+// together, so a broken transfer never shows half of its changes. a
+// transfer of more entries is dropped.
+#define SPARSE_MAX_ENTRIES  12
+
+// transitions are kept like sparse updates, then every entry moves its LED
+// to the color in (steps x TRANS_STEP_MS), a LED has one transition at a
+// time and steps 0 sets the color at once.
+#define TRANS_ENTRY_SIZE    6
+#define TRANS_STEP_MS       10
+
+// latch mode: LEDs keep the last frame and output waits in reset until a
+// commit, by the latch register or by I2C general call, so controllers on
+// one bus show their frames at the same time.
+#define LATCH_ENABLE        0x01
+#define LATCH_COMMIT        0x02    // write only.
+// second byte of general call, 0x04 and 0x06 are used by I2C spec.
+#define I2C_GCALL_COMMIT    0x08
+
+// CRC mode: every write carries CRC-8(SMBus PEC, poly 0x07) of the
+// address byte, register address and data as its last byte. data is kept
+// until stop and only used when CRC is right. a write of register address
+// only is not checked, it sets address for a read.
+#define CRC_ENABLE          0x01
+#define CRC_BUF_SIZE        32      // data bytes of one write, with CRC.
+
+// stream mode: writes have no register address, all bytes go to pixel
+// buffer from where last write stops and wrap at the end. a write without
+// data leaves stream mode, host must leave it before reading registers, or
+// the register address of the read goes to pixel buffer.
+#define STREAM_ON           0x01    // read only.
+#define STREAM_COMMIT       0x02    // commit when it wraps.
+
+// effects run in main loop on LEDs [fx_start, fx_start + fx_count) and
+// step every (fx_speed + 1) x FX_STEP_MS, fx_count 0 is to the last LED.
+// the palette of an effect is fx_color only, there is no RAM for more,
+// rainbow and fire have their own colors.
+#define FX_NONE             0
+#define FX_BREATHE          1       // fx_color fades in and out.
+#define FX_RAINBOW          2       // color wheel moves along the LEDs.
+#define FX_CHASE            3       // every third LED in fx_color, moving.
+#define FX_TWINKLE          4       // random LEDs light in fx_color and fade.
+#define FX_WIPE             5       // fill LEDs one by one, then clear them.
+#define FX_FIRE             6       // random flicker of fire colors.
+#define FX_STEP_MS          4
+
+// crossfade: write FADE_START to fade, pixel buffer moves to back buffer
+// in fade_ms and then back buffer is copied to pixel buffer, fade_ms 0
+// shows back buffer at once.
+#define FADE_START          0x01
+
+// interpolation: LED commit(latch register or general call) of a frame in
+// back buffer starts the move from the last frame to it, frame_ms reads the
+// time between the last two commits, up to INTERP_MAX_MS.
+#define INTERP_ON           0x01
+#define INTERP_MAX_MS       500
+
+// clip: host writes clip_pages x 64 bytes to pixel buffer(in latch mode to
+// hide them) and CONFIG_SAVE to clip_save, they are saved to flash from
+// clip_page. a clip is its size(2 bytes, little endian) and RLE stream of
+// register 0x4000 from LED 0, every frame ends by 0x00, so skip runs make
+// delta frames. write CLIP_PLAY to clip to play it at clip_fps.
+#define CLIP_PLAY           0x01
+#define CLIP_LOOP           0x02    // play again at the end.
+
+// scene: write slot and operation together, save and delete wait until
+// the bus is idle. a saved slot 0 is loaded at power on.
+#define SCENE_NONE          0
+#define SCENE_LOAD          1       // copy slot to pixel buffer.
+#define SCENE_DELETE        2       // forget the slot.
+#define SCENE_SAVE          CONFIG_SAVE // copy pixel buffer to slot.
+
+// write to cfg_save to store config(I2C addresses, color order, LED count,
+// latch and CRC mode) to flash and use them.
+#define CONFIG_SAVE         0xa5
+
+// presentation time: host reads tick to sync its clock to SysTick(TICK_HZ,
+// 6MHz at 48MHz HCLK, wraps in about 12 minutes), writes pts of a frame(its
+// last byte arms it) and commits, the frame shows when tick reaches pts in
+// latch mode. a commit after its pts shows at once and counts as late.
+
+// color order of LEDs on the wire, buffers are always GRB.
+#define ORDER_GRB           0
+#define ORDER_RGB           1
+#define ORDER_BRG           2
+#define ORDER_RBG           3
+#define ORDER_GBR           4
+#define ORDER_BGR           5
+#define ORDER_COUNT         6
+
+// control registers, offset from REG_CTRL(or in page IS31_PAGE_CTRL),
+// multi-byte registers are little endian.
+struct ctrl_regs {
+    uint8_t status;         // 0x00: status bits, write 1 to clear.
+    uint8_t win_errors;     // 0x01: RLE, sparse update and transition error count.
+    uint16_t cmd_start;     // 0x02: first LED of command.
+    uint16_t cmd_count;     // 0x04: LED count of command.
+    uint16_t cmd_arg;       // 0x06: argument of command.
+    uint8_t cmd_color[3];   // 0x08: R, G, B of command.
+    uint8_t cmd_op;         // 0x0b: write to run command, reads 0 when done.
+    uint32_t rx_bytes;      // 0x0c: data bytes received, read only.
+    uint32_t rx_rate;       // 0x10: data bytes received in last second, read only.
+    uint16_t berr_count;    // 0x14: bus errors, read only.
+    uint16_t arlo_count;    // 0x16: arbitration lost, read only.
+    uint16_t af_count;      // 0x18: ack failures(host ends a read by NACK), read only.
+    uint16_t ovr_count;     // 0x1a: overrun/underrun, read only.
+    uint16_t bus_resets;    // 0x1c: I2C reset by stall watchdog, read only.
+    uint8_t latch;          // 0x1e: latch mode and commit.
+    uint8_t i2c_addr;       // 0x1f: I2C address(7bit).
+    uint8_t i2c_addr2;      // 0x20: group address(7bit), 0 for none.
+    uint8_t cfg_save;       // 0x21: CONFIG_SAVE to save config, reads 0 when done.
+    uint8_t crc_mode;       // 0x22: CRC mode.
+    uint8_t crc_status;     // 0x23: 0 last checked write is good, 1 bad.
+    uint16_t crc_errors;    // 0x24: dropped writes, read only.
+    uint16_t uart_frames;   // 0x26: frames received by USART, read only.
+    uint16_t uart_errors;   // 0x28: broken USART frame headers, read only.
+    uint8_t stream;         // 0x2a: stream mode.
+    uint8_t fx_speed;       // 0x2b: effect step time.
+    uint16_t fx_start;      // 0x2c: first LED of effect.
+    uint16_t fx_count;      // 0x2e: LED count of effect.
+    uint8_t fx_color[3];    // 0x30: R, G, B
+    uint8_t fx;             // 0x33: effect, 0 stops it.
+    uint16_t fade_ms;       // 0x34: crossfade time.
+    uint8_t fade;           // 0x36: crossfade, reads 0 when done.
+    uint8_t interp;         // 0x37: interpolation mode.
+    uint16_t frame_ms;      // 0x38: frame interval of interpolation, read only.
+    uint8_t clip_page;      // 0x3a: first clip page to save.
+    uint8_t clip_pages;     // 0x3b: pages to save from pixel buffer.
+    uint8_t clip_save;      // 0x3c: CONFIG_SAVE to save, reads 0 when done.
+    uint8_t clip_fps;       // 0x3d: frames per second of clip.
+    uint8_t clip;           // 0x3e: clip playback, reads 0 when done.
+    uint8_t scene_slot;     // 0x3f: scene slot.
+    uint8_t scene_op;       // 0x40: scene operation, reads 0 when done.
+    uint8_t order;          // 0x41: color order of LEDs.
+    uint16_t led_count;     // 0x42: LEDs to send, 0 for all.
+    uint32_t tick;          // 0x44: SysTick when the read starts, read only.
+    uint32_t pts;           // 0x48: tick to show the next committed frame.
+    uint16_t pts_late;      // 0x4c: frames committed after their pts, read only.
+};
+#define CTRL(field)         offsetof(struct ctrl_regs, field)
+
+volatile static struct ctrl_regs ctrl;
 
 volatile static uint8_t cid = SPI_RESET_COUNT;
+volatile static uint8_t color;
 volatile static uint16_t pid;
-volatile static uint8_t pixel[WS2812_MAX_LEDS * 3];
+// end of pid for LED count, GRB byte of the LED(palette mode uses pch) and
+// buffer byte of every byte on the wire for color order.
+volatile static uint16_t pixel_end;
+volatile static uint8_t wch;
+volatile static uint8_t wire_order[3] = {0, 1, 2};
 volatile static uint16_t i2c_flag, i2c_reg;
+volatile static uint8_t i2c_events;
+// this device is addressed, from ADDR until stop, NACK or error.
+volatile static uint8_t i2c_addressed;
+volatile static uint8_t i2c_gcall;
+volatile static uint8_t spi_commit;
+#ifdef WS2812_INTERPOLATE
+// host commits a frame, for interpolation.
+volatile static uint8_t frame_commit;
+#endif
+// pts is written and the next commit waits for it, commit is waiting.
+volatile static uint8_t pts_armed, pts_wait;
 const uint8_t pixel_map[4] = {0x88, 0x8c, 0xc8, 0xcc};
 
-INTERRUPT void SPI1_IRQHandler(void)
+#ifdef WS2812_PALETTE_BITS
+#ifdef IS31FL3731_COMPATIBLE
+#error "palette mode is not supported by IS31FL3731 compatible mode."
+#endif
+#if defined(WS2812_BACK_BUFFER) || defined(WS2812_TRANSITIONS) || \
+    defined(CLIP_FLASH_SIZE) || defined(SCENE_SLOTS)
+#error "back buffer, transitions, clips and scenes are not supported by palette mode."
+#endif
+// pid walks LEDs, pch walks GRB bytes of the LED palette color.
+volatile static uint8_t pch;
+volatile static uint8_t pixel[WS2812_MAX_LEDS * WS2812_PALETTE_BITS / 8];
+volatile static uint8_t palette[WS2812_PALETTE_SIZE][3];
+
+static inline uint8_t pixel_fetch(void)
+{
+#if WS2812_PALETTE_BITS == 4
+    // first LED in high nibble, second LED in low nibble.
+    uint8_t index = (pixel[pid >> 1] >> ((~pid & 1) << 2)) & 0x0f;
+#else
+    uint8_t index = pixel[pid] & (WS2812_PALETTE_SIZE - 1);
+#endif
+    return palette[index][wire_order[pch]];
+}
+#elif defined(IS31FL3731_COMPATIBLE)
+#if defined(WS2812_BACK_BUFFER) || defined(WS2812_TRANSITIONS) || \
+    defined(CLIP_FLASH_SIZE)
+#error "back buffer, transitions and clips are not supported by IS31FL3731 compatible mode."
+#endif
+// frame page 0 is the pixel buffer of other modes, SPI sends the frame
+// selected by function page, it only changes between frames.
+volatile static uint8_t frame[IS31_FRAMES][WS2812_MAX_LEDS * 3];
+#define pixel               frame[0]
+volatile static uint8_t *is31_show = frame[0], *show = frame[0];
+// brightness of breath(0 when dark), blink off phase and GRB ordered blink
+// bits of the frame shown, only first 144 bytes of a frame have blink bits.
+volatile static uint8_t is31_level = 0xff, show_level = 0xff;
+volatile static uint8_t is31_blink_off, show_blink_off;
+volatile static uint8_t blink_mask[18];
+
+// v * (s + 1) / 256 by shift and add, there is no multiply instruction.
+static inline uint8_t scale8(uint8_t v, uint8_t s)
+{
+    uint16_t r = v;
+
+    for (uint8_t i = 0; i < 8; i++, s >>= 1) {
+        if (s & 1)
+            r += (uint16_t)v << i;
+    }
+    return r >> 8;
+}
+
+static inline uint8_t pixel_fetch(void)
+{
+    uint16_t i = pid - wch + wire_order[wch];
+    uint8_t v = show[i];
+
+    if (show_blink_off && i < sizeof(blink_mask) * 8 &&
+        (blink_mask[i >> 3] >> (i & 7)) & 1)
+        return 0;
+    return show_level == 0xff ? v : scale8(v, show_level);
+}
+#elif defined(WS2812_BACK_BUFFER)
+volatile static uint8_t pixel[WS2812_MAX_LEDS * 3];
+volatile static uint8_t back[sizeof(pixel)];
+#ifdef WS2812_INTERPOLATE
+// LEDs blend to a copy of back buffer, host writes the next frame meanwhile.
+volatile static uint8_t target[sizeof(pixel)];
+#else
+#define target              back
+#endif
+// weight of target in blend(0-256), it takes effect at once so pixel
+// buffer and target can be swapped by copy without a glitch.
+volatile static uint16_t fade_w;
+
+// a + (b - a) * w / 256 by shift and add, there is no multiply instruction.
+static inline uint8_t blend8(uint8_t a, uint8_t b, uint16_t w)
+{
+    uint8_t d = a < b ? b - a : a - b;
+    uint16_t r = 0x80;
+
+    for (uint8_t i = 0; i < 9; i++, w >>= 1) {
+        if (w & 1)
+            r += (uint16_t)d << i;
+    }
+    r >>= 8;
+    return a < b ? a + r : a - r;
+}
+
+static inline uint8_t pixel_fetch(void)
+{
+    uint16_t i = pid - wch + wire_order[wch];
+
+    return fade_w ? blend8(pixel[i], target[i], fade_w) : pixel[i];
+}
+#else
+volatile static uint8_t pixel[WS2812_MAX_LEDS * 3];
+
+static inline uint8_t pixel_fetch(void)
+{
+    return pixel[pid - wch + wire_order[wch]];
+}
+#endif
+
+// LEDs sent by SPI, 0 or more than buffer is all of them. shift and add
+// as it runs from I2C interrupt too.
+static void led_count_apply(void)
+{
+    uint16_t n = ctrl.led_count;
+
+    if (n == 0 || n > WS2812_MAX_LEDS)
+        n = WS2812_MAX_LEDS;
+#ifdef WS2812_PALETTE_BITS
+    pixel_end = n;
+#else
+    pixel_end = (n << 1) + n;
+#endif
+}
+
+static void order_apply(void)
+{
+    static const uint8_t orders[ORDER_COUNT][3] = {
+        {0, 1, 2}, {1, 0, 2}, {2, 1, 0}, {1, 2, 0}, {0, 2, 1}, {2, 0, 1}
+    };
+
+    for (uint8_t i = 0; i < 3; i++)
+        wire_order[i] = orders[ctrl.order][i];
+}
+
+// CRC-8 of SMBus PEC, four bits a step.
+static uint8_t crc8(uint8_t crc, uint8_t data)
+{
+    static const uint8_t table[16] = {
+        0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+        0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d
+    };
+
+    crc ^= data;
+    crc = (crc << 4) ^ table[crc >> 4];
+    crc = (crc << 4) ^ table[crc >> 4];
+    return crc;
+}
+
+// show the frame committed by host.
+static void frame_present(void)
+{
+    spi_commit = 1;
+#ifdef WS2812_INTERPOLATE
+    frame_commit = 1;
+#endif
+}
+
+// host commits a frame by latch register or general call, it waits for
+// its presentation time if pts is armed.
+static void host_commit(void)
+{
+    if (pts_armed && (int32_t)(ctrl.pts - TICK_NOW()) > 0) {
+        pts_wait = 1;
+    } else {
+        if (pts_armed)
+            ctrl.pts_late++;
+        frame_present();
+    }
+    pts_armed = 0;
+}
+
+static void ctrl_write(uint16_t offset, uint8_t data)
+{
+    switch (offset) {
+    case CTRL(status):
+        ctrl.status &= ~data;
+        break;
+    case CTRL(latch):
+        ctrl.latch = data & LATCH_ENABLE;
+        if (data & LATCH_COMMIT)
+            host_commit();
+        break;
+    case CTRL(pts):
+    case CTRL(pts) + 1:
+    case CTRL(pts) + 2:
+    case CTRL(pts) + 3:
+        ((volatile uint8_t *)&ctrl)[offset] = data;
+        if (offset == CTRL(pts) + 3)
+            pts_armed = 1;
+        break;
+    case CTRL(i2c_addr):
+    case CTRL(i2c_addr2):
+    case CTRL(cfg_save):
+    case CTRL(crc_mode):
+    case CTRL(clip_page):
+    case CTRL(clip_pages):
+    case CTRL(clip_fps):
+    case CTRL(scene_slot):
+        ((volatile uint8_t *)&ctrl)[offset] = data;
+        break;
+    case CTRL(order):
+        if (data < ORDER_COUNT) {
+            ctrl.order = data;
+            order_apply();
+        } else {
+            ctrl.status |= STATUS_CFG_ERROR;
+        }
+        break;
+    case CTRL(led_count):
+    case CTRL(led_count) + 1:
+        ((volatile uint8_t *)&ctrl)[offset] = data;
+        led_count_apply();
+        break;
+    case CTRL(scene_op):
+#ifdef SCENE_SLOTS
+        ctrl.scene_op = data;
+#else
+        ctrl.status |= STATUS_CMD_ERROR;
+#endif
+        break;
+    case CTRL(clip_save):
+    case CTRL(clip):
+#ifdef CLIP_FLASH_SIZE
+        ((volatile uint8_t *)&ctrl)[offset] = data;
+#else
+        ctrl.status |= STATUS_CMD_ERROR;
+#endif
+        break;
+    case CTRL(stream):
+        ctrl.stream = (ctrl.stream & STREAM_ON) | (data & STREAM_COMMIT);
+        break;
+    case CTRL(fade):
+#ifdef WS2812_BACK_BUFFER
+        ctrl.fade = data & FADE_START;
+#else
+        ctrl.status |= STATUS_CMD_ERROR;
+#endif
+        break;
+    case CTRL(interp):
+#ifdef WS2812_INTERPOLATE
+        ctrl.interp = data & INTERP_ON;
+#else
+        ctrl.status |= STATUS_CMD_ERROR;
+#endif
+        break;
+    case CTRL(cmd_op):
+    case CTRL(fx):
+#if !defined(IS31FL3731_COMPATIBLE) && !defined(WS2812_PALETTE_BITS)
+        ((volatile uint8_t *)&ctrl)[offset] = data;
+#else
+        ctrl.status |= STATUS_CMD_ERROR;
+#endif
+        break;
+    default:
+        if (offset <= CTRL(cmd_op) ||
+            (offset >= CTRL(fx_speed) && offset < CTRL(fade)))
+            ((volatile uint8_t *)&ctrl)[offset] = data;
+        break;
+    }
+}
+
+static uint8_t ctrl_read(uint16_t offset)
+{
+    if (offset < sizeof(ctrl))
+        return ((volatile uint8_t *)&ctrl)[offset];
+    return 0x00;
+}
+
+#ifdef IS31FL3731_COMPATIBLE
+// function registers.
+#define IS31_CONFIG         0x00    // display mode [4:3], auto play start frame [2:0].
+#define IS31_PICTURE        0x01    // frame of picture mode [2:0].
+#define IS31_AUTO_PLAY1     0x02    // loops [6:4](0 endless), frames [2:0](0 all 8).
+#define IS31_AUTO_PLAY2     0x03    // frame delay [5:0] x 11ms(0 is 64).
+#define IS31_DISPLAY        0x05    // blink enable [3], blink period [2:0] x 0.27s.
+#define IS31_FRAME_STATE    0x07    // end of auto play [4], frame shown [2:0].
+#define IS31_BREATH1        0x08    // fade out [6:4], fade in [2:0], 26ms x 2^n.
+#define IS31_BREATH2        0x09    // breath enable [4], extinguish [2:0], 3.5ms x 2^n.
+#define IS31_SHUTDOWN       0x0a    // 0 shutdown, 1 normal.
+#define IS31_FUNC_SIZE      0x0d
+
+#define IS31_MODE_MASK      0x18
+#define IS31_MODE_PICTURE   0x00
+#define IS31_MODE_AUTO      0x08
+#define IS31_FRAME_INT      0x10
+#define IS31_BLINK_EN       0x08
+#define IS31_BREATH_EN      0x10
+
+// blink control registers of frame page, one bit for each PWM register.
+#define IS31_BLINK          0x12
+#define IS31_BLINK_SIZE     18
+
+// shutdown register starts at normal, drivers written for the old firmware
+// may never wake the device.
+volatile static uint8_t is31_func[IS31_FUNC_SIZE] = {[IS31_SHUTDOWN] = 1};
+volatile static uint8_t is31_state, is31_restart;
+volatile static uint8_t is31_blink[IS31_FRAMES][IS31_BLINK_SIZE];
+volatile static uint8_t is31_blink_dirty;
+
+// register of frame page to its byte, blink bits or pixel byte of PWM
+// register, IS31 is RGB but WS2812 is GRB.
+static volatile uint8_t *is31_frame_reg(uint8_t reg)
+{
+    uint8_t n = reg - 0x24;
+
+    if (i2c_page >= IS31_FRAMES)
+        return NULL;
+
+    if ((uint8_t)(reg - IS31_BLINK) < IS31_BLINK_SIZE) {
+        is31_blink_dirty = 1;
+        return &is31_blink[i2c_page][reg - IS31_BLINK];
+    }
+
+    if (reg < 0x24 || n >= sizeof(frame[0]))
+        return NULL;
+
+    switch (n % 3) {
+    case 0: n++; break;
+    case 1: n--; break;
+    }
+    return &frame[i2c_page][n];
+}
+
+static void is31_func_write(uint8_t reg, uint8_t data)
+{
+    if (reg >= IS31_FUNC_SIZE || reg == IS31_FRAME_STATE)
+        return;
+
+    is31_func[reg] = data;
+    // display mode or auto play changes, play again from start frame.
+    if (reg <= IS31_AUTO_PLAY2)
+        is31_restart = 1;
+}
+
+static uint8_t is31_func_read(uint8_t reg)
+{
+    uint8_t state;
+
+    if (reg == IS31_FRAME_STATE) {
+        // end of auto play is cleared by read.
+        state = is31_state;
+        is31_state &= ~IS31_FRAME_INT;
+        return state;
+    }
+    return reg < IS31_FUNC_SIZE ? is31_func[reg] : 0x00;
+}
+#endif
+
+#ifndef IS31FL3731_COMPATIBLE
+#ifndef WS2812_PALETTE_BITS
+// decode state of stream windows(packed colors and RLE), only one window
+// is used in a transfer so they share it.
+// packed colors: LED to write, byte phase of the LED(or LED pair for
+// RGB444) and bytes received in the phase.
+// RLE: LED to write, LED where stream starts, byte phase of the run and
+// run bytes received.
+// sparse and transition: bytes kept in sparse buffer.
+// win is the stream window selected by register address of the transfer,
+// data keeps going to it even when address grows out of the window.
+volatile static uint16_t win, win_led, win_start;
+volatile static uint8_t win_phase, win_data[3];
+volatile static uint8_t sparse[SPARSE_MAX_ENTRIES * 5];
+
+#ifdef WS2812_TRANSITIONS
+// LED, GRB target and steps left, the slot is free when steps is 0.
+struct trans {
+    uint16_t led;
+    uint8_t grb[3];
+    uint8_t steps;
+};
+volatile static struct trans trans[WS2812_TRANSITIONS];
+#endif
+
+static void pixel_set(uint16_t led, uint8_t r, uint8_t g, uint8_t b)
+{
+    if (led < WS2812_MAX_LEDS) {
+        volatile uint8_t *p = &pixel[led * 3];
+        // WS2812 is GRB.
+        p[0] = g;
+        p[1] = r;
+        p[2] = b;
+    }
+}
+
+static void pixel_fill(uint16_t led, uint16_t count, uint8_t r, uint8_t g, uint8_t b)
+{
+    while (count--)
+        pixel_set(led++, r, g, b);
+}
+
+// expand 3/4/5/6 bits color to 8 bits by replicating high bits to low.
+#define EXPAND3(v)          (((v) << 5) | ((v) << 2) | ((v) >> 1))
+#define EXPAND4(v)          (((v) << 4) | (v))
+#define EXPAND5(v)          (((v) << 3) | ((v) >> 2))
+#define EXPAND6(v)          (((v) << 2) | ((v) >> 4))
+
+// RLE stream is a list of runs, first byte of run is:
+// 0x00: end of frame, next run starts from the start LED again.
+// 0x01-0x7f: LED count, followed by R, G, B of these LEDs.
+// 0x80-0xff: skip (byte & 0x7f) + 1 LEDs, keep their colors.
+static void win_error(uint8_t status)
+{
+    ctrl.status |= status;
+    ctrl.win_errors++;
+}
+
+static void rle_write(uint8_t data)
+{
+    if (win_phase == 0) {
+        if (data == 0) {
+            win_led = win_start;
+        } else if (data & 0x80) {
+            win_led += (data & 0x7f) + 1;
+            if (win_led > WS2812_MAX_LEDS)
+                win_error(STATUS_RLE_ERROR);
+        } else {
+            win_data[0] = data;
+            win_phase = 1;
+        }
+    } else if (win_phase < 3) {
+        // R and G, wait for B.
+        win_data[win_phase++] = data;
+    } else {
+        if (win_led + win_data[0] > WS2812_MAX_LEDS)
+            win_error(STATUS_RLE_ERROR);
+        pixel_fill(win_led, win_data[0], win_data[1], win_data[2], data);
+        win_led += win_data[0];
+        win_phase = 0;
+    }
+}
+
+// apply sparse updates kept in buffer, win_led is bytes in buffer.
+static void sparse_apply(void)
+{
+    for (uint8_t i = 0; i + 5 <= win_led; i += 5) {
+        uint16_t led = ((uint16_t)sparse[i] << 8) | sparse[i + 1];
+        if (led >= WS2812_MAX_LEDS)
+            win_error(STATUS_SPARSE_ERROR);
+        pixel_set(led, sparse[i + 2], sparse[i + 3], sparse[i + 4]);
+    }
+    win_led = 0;
+}
+
+static void sparse_write(uint8_t data)
+{
+    // more entries than buffer, the transfer is dropped when it stops.
+    if (win_led >= sizeof(sparse)) {
+        win_phase = 1;
+        return;
+    }
+    sparse[win_led++] = data;
+}
+
+#ifdef WS2812_TRANSITIONS
+// start transitions kept in sparse buffer, a new entry of a LED replaces
+// its running transition.
+static void trans_apply(void)
+{
+    volatile struct trans *t, *slot;
+    volatile uint8_t *e;
+    uint16_t led;
+    uint8_t i, n;
+
+    for (i = 0; i + TRANS_ENTRY_SIZE <= win_led; i += TRANS_ENTRY_SIZE) {
+        e = &sparse[i];
+        led = ((uint16_t)e[0] << 8) | e[1];
+        if (led >= WS2812_MAX_LEDS) {
+            win_error(STATUS_TRANS_ERROR);
+            continue;
+        }
+        slot = 0;
+        for (n = 0, t = trans; n < WS2812_TRANSITIONS; n++, t++) {
+            if (t->steps && t->led == led) {
+                slot = t;
+                break;
+            }
+            if (!t->steps && !slot)
+                slot = t;
+        }
+        if (e[5] == 0 || !slot) {
+            // full table sets the color at once.
+            if (e[5] && !slot)
+                win_error(STATUS_TRANS_ERROR);
+            if (slot)
+                slot->steps = 0;
+            pixel_set(led, e[2], e[3], e[4]);
+            continue;
+        }
+        // steps goes last, main loop only looks at slots with steps.
+        slot->steps = 0;
+        slot->led = led;
+        slot->grb[0] = e[3];
+        slot->grb[1] = e[2];
+        slot->grb[2] = e[4];
+        slot->steps = e[5];
+    }
+    win_led = 0;
+}
+
+static void trans_write(uint8_t data)
+{
+    // more whole entries than buffer, the transfer is dropped when it stops.
+    if (win_led + TRANS_ENTRY_SIZE > sizeof(sparse) && win_led % TRANS_ENTRY_SIZE == 0) {
+        win_phase = 1;
+        return;
+    }
+    sparse[win_led++] = data;
+}
+#endif
+
+// register address points into a stream window, locate LED and phase.
+static void win_begin(uint16_t reg)
+{
+    uint16_t offset = reg & 0x0fff;
+
+    win = REG_WINDOW(reg);
+    switch (win) {
+    case REG_RGB565:
+        win_led = offset >> 1;
+        win_phase = offset & 1;
+        break;
+    case REG_RGB444:
+        win_led = offset / 3 * 2;
+        win_phase = offset % 3;
+        break;
+    case REG_RGB332:
+        win_led = offset;
+        break;
+    case REG_RLE:
+        win_led = win_start = offset;
+        win_phase = 0;
+        break;
+    case REG_SPARSE:
+#ifdef WS2812_TRANSITIONS
+    case REG_TRANS:
+#endif
+        win_led = 0;
+        win_phase = 0;
+        break;
+    default:
+        win = 0;
+        break;
+    }
+}
+
+static void win_write(uint8_t data)
+{
+    switch (win) {
+    case REG_RGB565:
+        if (win_phase == 0) {
+            win_data[0] = data;
+            win_phase = 1;
+        } else {
+            uint16_t c = ((uint16_t)win_data[0] << 8) | data;
+            pixel_set(win_led++, EXPAND5(c >> 11),
+                      EXPAND6((c >> 5) & 0x3f), EXPAND5(c & 0x1f));
+            win_phase = 0;
+        }
+        break;
+    case REG_RGB444:
+        if (win_phase == 0) {
+            // R0G0, keep it until B0 comes.
+            win_data[0] = data;
+            win_phase = 1;
+        } else if (win_phase == 1) {
+            // B0R1, first LED done, keep R1.
+            pixel_set(win_led++, EXPAND4(win_data[0] >> 4),
+                      EXPAND4(win_data[0] & 0x0f), EXPAND4(data >> 4));
+            win_data[0] = data & 0x0f;
+            win_phase = 2;
+        } else {
+            // G1B1, second LED done.
+            pixel_set(win_led++, EXPAND4(win_data[0]),
+                      EXPAND4(data >> 4), EXPAND4(data & 0x0f));
+            win_phase = 0;
+        }
+        break;
+    case REG_RGB332:
+        pixel_set(win_led++, EXPAND3(data >> 5),
+                  EXPAND3((data >> 2) & 7), (data & 3) * 0x55);
+        break;
+    case REG_RLE:
+        rle_write(data);
+        break;
+    case REG_SPARSE:
+        sparse_write(data);
+        break;
+#ifdef WS2812_TRANSITIONS
+    case REG_TRANS:
+        trans_write(data);
+        break;
+#endif
+    }
+}
+
+// transfer stops, a RLE run, sparse or transition entry must not be cut in
+// the middle.
+static void win_end(void)
+{
+    if (win == REG_RLE && win_phase != 0) {
+        win_error(STATUS_RLE_ERROR);
+        win_phase = 0;
+    } else if (win == REG_SPARSE) {
+        // transfer is broken or too long, drop all of its entries.
+        if (win_phase || win_led % 5) {
+            win_error(STATUS_SPARSE_ERROR);
+            win_led = 0;
+        }
+        win_phase = 0;
+        sparse_apply();
+#ifdef WS2812_TRANSITIONS
+    } else if (win == REG_TRANS) {
+        if (win_phase || win_led % TRANS_ENTRY_SIZE) {
+            win_error(STATUS_TRANS_ERROR);
+            win_led = 0;
+        }
+        win_phase = 0;
+        trans_apply();
+#endif
+    }
+    win = 0;
+}
+#endif
+
+// write one byte to register map, pixel buffer is normally filled by DMA.
+static void i2c_write(uint16_t reg, uint8_t data)
+{
+#ifndef WS2812_PALETTE_BITS
+    if (win) {
+        win_write(data);
+        return;
+    }
+#endif
+    if (reg < sizeof(pixel)) {
+        pixel[reg] = data;
+#ifdef WS2812_BACK_BUFFER
+    } else if ((uint16_t)(reg - REG_BACK) < sizeof(back)) {
+        back[reg - REG_BACK] = data;
+#endif
+#ifdef WS2812_PALETTE_BITS
+    } else if ((uint16_t)(reg - REG_PALETTE) < sizeof(palette)) {
+        ((volatile uint8_t *)palette)[reg - REG_PALETTE] = data;
+#endif
+    } else if (REG_WINDOW(reg) == REG_CTRL) {
+        ctrl_write(reg - REG_CTRL, data);
+    }
+}
+
+static uint8_t i2c_read(uint16_t reg)
+{
+    if (reg < sizeof(pixel))
+        return pixel[reg];
+#ifdef WS2812_BACK_BUFFER
+    if ((uint16_t)(reg - REG_BACK) < sizeof(back))
+        return back[reg - REG_BACK];
+#endif
+#ifdef WS2812_PALETTE_BITS
+    if ((uint16_t)(reg - REG_PALETTE) < sizeof(palette))
+        return ((volatile uint8_t *)palette)[reg - REG_PALETTE];
+#endif
+    if (REG_WINDOW(reg) == REG_CTRL)
+        return ctrl_read(reg - REG_CTRL);
+    return 0x00;
+}
+
+// CRC of write so far, data kept for check and its count.
+volatile static uint8_t i2c_crc, crc_on, crc_len;
+volatile static uint8_t crc_buf[CRC_BUF_SIZE];
+
+static void crc_write(uint8_t data)
+{
+    i2c_crc = crc8(i2c_crc, data);
+    if (crc_len < CRC_BUF_SIZE)
+        crc_buf[crc_len] = data;
+    // count one more than buffer to mark overflow.
+    if (crc_len <= CRC_BUF_SIZE)
+        crc_len++;
+}
+
+// check CRC at end of write, CRC of all bytes with the right CRC is 0.
+// good data is written to register map as a normal write.
+static void crc_end(void)
+{
+    uint8_t i;
+
+    crc_on = 0;
+    if (crc_len == 0)
+        return;
+
+    if (crc_len > CRC_BUF_SIZE || i2c_crc) {
+        ctrl.crc_status = 1;
+        ctrl.crc_errors++;
+        return;
+    }
+    ctrl.crc_status = 0;
+
+#ifndef WS2812_PALETTE_BITS
+    if (i2c_reg >= sizeof(pixel))
+        win_begin(i2c_reg);
+#endif
+    for (i = 0; i < crc_len - 1; i++)
+        i2c_write(i2c_reg++, crc_buf[i]);
+    ctrl.rx_bytes += i;
+}
+
+// registers received by DMA.
+#ifdef WS2812_BACK_BUFFER
+#define I2C_DMA_RX_REG(reg) ((reg) < sizeof(pixel) || \
+                             (uint16_t)((reg) - REG_BACK) < sizeof(back))
+#else
+#define I2C_DMA_RX_REG(reg) ((reg) < sizeof(pixel))
+#endif
+
+// start to receive pixel data from i2c_reg by DMA, RXNE interrupt is
+// disabled until the transfer stops or the buffer is full.
+static void i2c_dma_rx_start(void)
+{
+    volatile uint8_t *data = &pixel[i2c_reg];
+
+    i2c_dma_end = sizeof(pixel);
+#ifdef WS2812_BACK_BUFFER
+    if (i2c_reg >= REG_BACK) {
+        data = &back[i2c_reg - REG_BACK];
+        i2c_dma_end = REG_BACK + sizeof(back);
+    }
+#endif
+    I2C_RX_DMA->MADDR = (uint32_t)data;
+    DMA_SetCurrDataCounter(I2C_RX_DMA, i2c_dma_end - i2c_reg);
+    DMA_Cmd(I2C_RX_DMA, ENABLE);
+
+    I2C_ITConfig(I2C1, I2C_IT_BUF, DISABLE);
+    I2C_DMACmd(I2C1, ENABLE);
+    i2c_dma = I2C_DMA_RX;
+}
+
+// stop DMA and hand the data register back to I2C interrupt, i2c_reg
+// moves to the next byte that DMA has not received.
+static void i2c_dma_rx_stop(void)
+{
+    uint16_t reg;
+
+    I2C_DMACmd(I2C1, DISABLE);
+    DMA_Cmd(I2C_RX_DMA, DISABLE);
+    I2C_ITConfig(I2C1, I2C_IT_BUF, ENABLE);
+
+    reg = i2c_dma_end - DMA_GetCurrDataCounter(I2C_RX_DMA);
+    ctrl.rx_bytes += reg - i2c_reg;
+    i2c_reg = reg;
+    i2c_dma = 0;
+}
+
+// start to send pixel buffer, back buffer or control registers by DMA,
+// other registers are sent by TXE interrupt.
+static void i2c_dma_tx_start(void)
+{
+    volatile uint8_t *data;
+
+    if (i2c_reg < sizeof(pixel)) {
+        data = &pixel[i2c_reg];
+        i2c_dma_end = sizeof(pixel);
+#ifdef WS2812_BACK_BUFFER
+    } else if ((uint16_t)(i2c_reg - REG_BACK) < sizeof(back)) {
+        data = &back[i2c_reg - REG_BACK];
+        i2c_dma_end = REG_BACK + sizeof(back);
+#endif
+    } else if ((uint16_t)(i2c_reg - REG_CTRL) < sizeof(ctrl)) {
+        data = (volatile uint8_t *)&ctrl + (i2c_reg - REG_CTRL);
+        i2c_dma_end = REG_CTRL + sizeof(ctrl);
+    } else {
+        return;
+    }
+
+    I2C_TX_DMA->MADDR = (uint32_t)data;
+    DMA_SetCurrDataCounter(I2C_TX_DMA, i2c_dma_end - i2c_reg);
+    DMA_Cmd(I2C_TX_DMA, ENABLE);
+
+    I2C_ITConfig(I2C1, I2C_IT_BUF, DISABLE);
+    I2C_DMACmd(I2C1, ENABLE);
+    i2c_dma = I2C_DMA_TX;
+}
+
+// stop DMA and hand the data register back to I2C interrupt, i2c_reg
+// moves to the next byte that DMA has not loaded, the last loaded byte may
+// not be sent when host ends the read.
+static void i2c_dma_tx_stop(void)
+{
+    I2C_DMACmd(I2C1, DISABLE);
+    DMA_Cmd(I2C_TX_DMA, DISABLE);
+    I2C_ITConfig(I2C1, I2C_IT_BUF, ENABLE);
+
+    i2c_reg = i2c_dma_end - DMA_GetCurrDataCounter(I2C_TX_DMA);
+    i2c_dma = 0;
+}
+
+// write of stream mode, the one enters stream mode may have no data.
+#define STREAM_WRITE_ENTER  1
+#define STREAM_WRITE        2
+volatile static uint8_t stream_write;
+volatile static uint16_t stream_reg;
+volatile static uint32_t stream_bytes;
+
+static void stream_begin(uint8_t type)
+{
+    stream_write = type;
+    stream_bytes = ctrl.rx_bytes;
+    i2c_flag = 2;
+    i2c_dma_rx_start();
+}
+
+static void stream_end(void)
+{
+    if (stream_write == STREAM_WRITE && ctrl.rx_bytes == stream_bytes)
+        ctrl.stream &= ~STREAM_ON;
+    stream_write = 0;
+
+    stream_reg = i2c_reg;
+    if (stream_reg >= sizeof(pixel)) {
+        stream_reg = 0;
+        if (ctrl.stream & STREAM_COMMIT)
+            spi_commit = 1;
+    }
+}
+
+// transfer ends by stop or repeated start.
+static void i2c_end(void)
+{
+    if (i2c_dma == I2C_DMA_RX)
+        i2c_dma_rx_stop();
+    else if (i2c_dma == I2C_DMA_TX)
+        i2c_dma_tx_stop();
+    if (stream_write)
+        stream_end();
+    if (crc_on)
+        crc_end();
+#ifndef WS2812_PALETTE_BITS
+    win_end();
+#endif
+}
+#endif
+
+// drop current transfer, next write begins with register address again.
+static void i2c_resync(void)
+{
+#ifndef IS31FL3731_COMPATIBLE
+    crc_on = 0;
+    ctrl.stream &= ~STREAM_ON;
+#ifndef WS2812_PALETTE_BITS
+    // entries of sparse or transition window are dropped, not applied.
+    win = 0;
+    win_led = 0;
+    win_phase = 0;
+#endif
+    i2c_end();
+#endif
+    i2c_flag = 0;
+    i2c_addressed = 0;
+}
+
+INTERRUPT void SPI1_IRQHandler(void)
+{
+    if (SPI_I2S_GetITStatus(SPI1, SPI_I2S_IT_TXE)) {
+        // color id range [0:3]: we send color by bit.
+        // color id range [4:84]: we send zero only as reset.
+        if (cid < 4) {
+            SPI1->DATAR = pixel_map[(color >> (cid << 1)) & 3];
+
+            // one color has send to end, move to next color.
+            if (cid == 0) {
+#ifdef WS2812_PALETTE_BITS
+                if (++pch >= 3) {
+                    pch = 0;
+                    pid++;
+                }
+                if (pid >= pixel_end) {
+#else
+                if (++wch >= 3)
+                    wch = 0;
+                // if exceed the LED count, turn back to begin of the pixels.
+                if (++pid >= pixel_end) {
+                    wch = 0;
+#endif
+                    pid = 0;
+                    // we need to send reset to leds to show colors.
+                    cid = SPI_RESET_COUNT;
+                } else {
+                    // rearm the color id to send next color.
+                    cid = 4;
+                    color = pixel_fetch();
+                }
+            }
+        } else {
+            // reset mode, we send two 0 bits only.
+            SPI1->DATAR = 0;
+            // reset is going to end, prepare first color. in latch mode
+            // stay in reset until commit.
+            if (cid == 4) {
+                // tick reaches pts of the waiting frame, reset gap of latch
+                // mode checks it every few us.
+                if (pts_wait && (int32_t)(ctrl.pts - TICK_NOW()) <= 0) {
+                    pts_wait = 0;
+                    frame_present();
+                }
+                if ((ctrl.latch & LATCH_ENABLE) && !spi_commit)
+                    return;
+                spi_commit = 0;
+#ifdef IS31FL3731_COMPATIBLE
+                show = is31_show;
+                show_level = is31_level;
+                show_blink_off = is31_blink_off;
+#endif
+                color = pixel_fetch();
+            }
+        }
+
+        cid--;
+    }
+}
+
+INTERRUPT void I2C1_EV_IRQHandler(void)
+{
+    // read status once and access data register directly, this interrupt
+    // serves every byte that is not handled by DMA, at 1MHz a byte only
+    // takes 9us.
+    uint16_t star1 = I2C1->STAR1;
+
+    i2c_events++;
+    if (star1 & I2C_STAR1_ADDR) {
+        uint16_t star2 = I2C1->STAR2; // read to clear flag.
+
+        i2c_addressed = 1;
+#ifndef IS31FL3731_COMPATIBLE
+        // repeated start without stop, end previous transfer.
+        i2c_end();
+#endif
+        // get address, new write begins with register address, read goes
+        // on from register address of last write.
+        if (!(star2 & I2C_STAR2_TRA)) {
+            i2c_reg = i2c_flag = 0;
+#ifndef IS31FL3731_COMPATIBLE
+            // CRC begins with address byte, which may be the group address.
+            i2c_crc = crc8(0, (star2 & I2C_STAR2_DUALF ?
+                               I2C1->OADDR2 : I2C1->OADDR1) & 0xfe);
+            // stream mode, no register address, data goes on from last
+            // write.
+            if ((ctrl.stream & STREAM_ON) && !(star2 & I2C_STAR2_GENCALL)) {
+                i2c_reg = stream_reg;
+                stream_begin(STREAM_WRITE);
+            }
+#endif
+        }
+        // time of the read for clock sync of host, before DMA takes it.
+        if (star2 & I2C_STAR2_TRA)
+            ctrl.tick = TICK_NOW();
+#ifndef IS31FL3731_COMPATIBLE
+        // read begins, pixel buffer and control registers are sent by DMA.
+        if (star2 & I2C_STAR2_TRA)
+            i2c_dma_tx_start();
+#endif
+        i2c_gcall = star2 & I2C_STAR2_GENCALL;
+    } else if ((star1 & I2C_STAR1_RXNE) && i2c_gcall) {
+        // general call, commit frame of every controller on the bus.
+        if (I2C1->DATAR == I2C_GCALL_COMMIT)
+            host_commit();
+    } else if (star1 & I2C_STAR1_RXNE) {
+#ifdef IS31FL3731_COMPATIBLE
+        if (i2c_flag == 0) {
+            i2c_reg = I2C1->DATAR;
+            i2c_flag++;
+        } else if(i2c_reg == 0xfd) {
+            i2c_page = I2C1->DATAR;
+        } else if (i2c_page == IS31_PAGE_CTRL) {
+            ctrl_write(i2c_reg++, I2C1->DATAR);
+        } else if (i2c_page == IS31_PAGE_FUNC) {
+            is31_func_write(i2c_reg++, I2C1->DATAR);
+        } else {
+            // blink and PWM registers of a frame page, others are received
+            // but ignored.
+            volatile uint8_t *p = is31_frame_reg(i2c_reg++);
+            uint8_t data = I2C1->DATAR;
+            if (p)
+                *p = data;
+        }
+#else
+        switch (i2c_flag) {
+        case 0:   // receive register address high byte.
+            i2c_reg |= (uint16_t)I2C1->DATAR << 8;
+            i2c_crc = crc8(i2c_crc, i2c_reg >> 8);
+            i2c_flag++;
+            break;
+        case 1:   // receive register address low byte.
+            i2c_reg |= (uint16_t)I2C1->DATAR;
+            i2c_crc = crc8(i2c_crc, i2c_reg);
+            i2c_flag++;
+            // register address is ready, in CRC mode keep data until stop,
+            // or rest bytes are pixels for DMA.
+            if (REG_WINDOW(i2c_reg) == REG_STREAM &&
+                (uint16_t)(i2c_reg - REG_STREAM) < sizeof(pixel)) {
+                i2c_reg -= REG_STREAM;
+                ctrl.stream |= STREAM_ON;
+                stream_begin(STREAM_WRITE_ENTER);
+            } else if (ctrl.crc_mode & CRC_ENABLE) {
+                crc_on = 1;
+                crc_len = 0;
+            } else if (I2C_DMA_RX_REG(i2c_reg))
+                i2c_dma_rx_start();
+#ifndef WS2812_PALETTE_BITS
+            else
+                win_begin(i2c_reg);
+#endif
+            break;
+        default:
+            if (crc_on) {
+                crc_write(I2C1->DATAR);
+                break;
+            }
+            i2c_write(i2c_reg++, I2C1->DATAR);
+            ctrl.rx_bytes++;
+            break;
+        }
+#endif
+
+    } else if (star1 & I2C_STAR1_TXE) {
+#ifdef IS31FL3731_COMPATIBLE
+        if (i2c_page == IS31_PAGE_CTRL) {
+            I2C1->DATAR = ctrl_read(i2c_reg++);
+        } else if (i2c_page == IS31_PAGE_FUNC) {
+            I2C1->DATAR = is31_func_read(i2c_reg++);
+        } else {
+            volatile uint8_t *p = is31_frame_reg(i2c_reg++);
+            I2C1->DATAR = p ? *p : 0x00;
+        }
+#else
+        I2C1->DATAR = i2c_read(i2c_reg++);
+#endif
+    } else if (star1 & I2C_STAR1_STOPF) {
+        // STAR1 is read, write CTLR1 to clear STOPF.
+        I2C1->CTLR1 |= I2C_CTLR1_PE;
+        i2c_addressed = 0;
+#ifndef IS31FL3731_COMPATIBLE
+        i2c_end();
+#endif
+    }
+}
+
+INTERRUPT void I2C1_ER_IRQHandler(void)
+{
+    uint16_t star1 = I2C1->STAR1;
+    uint16_t error = star1 & (I2C_STAR1_BERR | I2C_STAR1_ARLO |
+                              I2C_STAR1_AF | I2C_STAR1_OVR);
+
+    if (error & I2C_STAR1_BERR)
+        ctrl.berr_count++;
+    if (error & I2C_STAR1_ARLO)
+        ctrl.arlo_count++;
+    if (error & I2C_STAR1_AF)
+        ctrl.af_count++;
+    if (error & I2C_STAR1_OVR)
+        ctrl.ovr_count++;
+
+    // error flags are cleared by writing 0.
+    I2C1->STAR1 = ~error;
+
+    // AF is how host ends a read, others break the transfer, resync and
+    // wait for next start.
+    if (error & (I2C_STAR1_BERR | I2C_STAR1_ARLO | I2C_STAR1_OVR)) {
+        i2c_resync();
+    } else if (error & I2C_STAR1_AF) {
+        i2c_addressed = 0;
+#ifndef IS31FL3731_COMPATIBLE
+        i2c_end();
+#endif
+    }
+}
+
+#ifndef IS31FL3731_COMPATIBLE
+INTERRUPT void DMA1_Channel6_IRQHandler(void)
+{
+    if (DMA_GetITStatus(DMA1_IT_TC6)) {
+        DMA_ClearITPendingBit(DMA1_IT_TC6);
+        // end of pixel buffer or control registers, rest bytes of this
+        // read are sent by I2C interrupt.
+        i2c_dma_tx_stop();
+    }
+}
+
+INTERRUPT void DMA1_Channel7_IRQHandler(void)
+{
+    if (DMA_GetITStatus(DMA1_IT_TC7)) {
+        DMA_ClearITPendingBit(DMA1_IT_TC7);
+        // transfer may stop before this interrupt.
+        if (i2c_dma != I2C_DMA_RX)
+            return;
+        // buffer is full, rest bytes of this transfer are received
+        // and dropped by I2C interrupt, or wrap to begin in stream mode.
+        i2c_dma_rx_stop();
+        if (stream_write) {
+            i2c_reg = 0;
+            if (ctrl.stream & STREAM_COMMIT)
+                spi_commit = 1;
+            i2c_dma_rx_start();
+        }
+    }
+}
+#endif
+
+#ifdef USART_BAUD
+// frame header is parsed by RXNE interrupt, then LED data goes to pixel
+// buffer by DMA1 channel 5(USART1 RX request) and bytes out of the buffer
+// are skipped by interrupt again.
+// Adalight: 'A' 'd' 'a' count-1(high, low) check(high ^ low ^ 0x55), RGB.
+// TPM2: 0xc9 0xda size(high, low) data 0x36.
+#define UART_RX_DMA         DMA1_Channel5
+#define UART_SYNC           0
+#define UART_ADA            1       // 'A' received, 5 more header bytes.
+#define UART_TPM2           6       // 0xc9 received, 3 more header bytes.
+#define UART_DATA           9       // DMA receives LED data.
+#define UART_SKIP           10      // skip rest of frame.
+
+volatile static uint8_t uart_state;
+volatile static uint16_t uart_len, uart_skip;
+
+static void uart_frame_end(void)
+{
+    ctrl.uart_frames++;
+    // frame is complete, show it in latch mode.
+    spi_commit = 1;
+    uart_state = UART_SYNC;
+}
+
+// broken header, wait for next frame.
+static void uart_resync(void)
+{
+    ctrl.uart_errors++;
+    uart_state = UART_SYNC;
+}
+
+// receive size bytes of LED data and then skip tail bytes.
+static void uart_rx_dma_start(uint16_t size, uint8_t tail)
+{
+    uint16_t count = size < sizeof(pixel) ? size : sizeof(pixel);
+
+    uart_skip = size - count + tail;
+    if (count == 0) {
+        uart_state = UART_SKIP;
+        if (uart_skip == 0)
+            uart_frame_end();
+        return;
+    }
+
+    UART_RX_DMA->MADDR = (uint32_t)pixel;
+    DMA_SetCurrDataCounter(UART_RX_DMA, count);
+    DMA_Cmd(UART_RX_DMA, ENABLE);
+
+    USART_ITConfig(USART1, USART_IT_RXNE, DISABLE);
+    USART_DMACmd(USART1, USART_DMAReq_Rx, ENABLE);
+    uart_state = UART_DATA;
+}
+
+static void uart_rx_dma_stop(void)
+{
+    USART_DMACmd(USART1, USART_DMAReq_Rx, DISABLE);
+    DMA_Cmd(UART_RX_DMA, DISABLE);
+    USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
+}
+
+INTERRUPT void USART1_IRQHandler(void)
+{
+    uint8_t data;
+
+    if (!(USART1->STATR & USART_STATR_RXNE))
+        return;
+    data = USART1->DATAR;
+
+    switch (uart_state) {
+    case UART_SYNC:
+        if (data == 'A')
+            uart_state = UART_ADA;
+        else if (data == 0xc9)
+            uart_state = UART_TPM2;
+        return;
+    case UART_ADA:
+    case UART_ADA + 1:
+        if (data != (uart_state == UART_ADA ? 'd' : 'a')) {
+            uart_resync();
+            return;
+        }
+        break;
+    case UART_ADA + 2:
+    case UART_TPM2 + 1:
+        uart_len = (uint16_t)data << 8;
+        break;
+    case UART_ADA + 3:
+    case UART_TPM2 + 2:
+        uart_len |= data;
+        if (uart_state == UART_TPM2 + 2) {
+            uart_rx_dma_start(uart_len, 1);
+            return;
+        }
+        break;
+    case UART_ADA + 4:
+        if (data != ((uart_len >> 8) ^ (uart_len & 0xff) ^ 0x55)) {
+            uart_resync();
+            return;
+        }
+        uart_rx_dma_start((uart_len + 1) * 3, 0);
+        return;
+    case UART_TPM2:
+        // only data frames, command frames are dropped.
+        if (data != 0xda) {
+            uart_resync();
+            return;
+        }
+        break;
+    case UART_SKIP:
+        if (--uart_skip == 0)
+            uart_frame_end();
+        return;
+    }
+    uart_state++;
+}
+
+INTERRUPT void DMA1_Channel5_IRQHandler(void)
+{
+    if (DMA_GetITStatus(DMA1_IT_TC5)) {
+        DMA_ClearITPendingBit(DMA1_IT_TC5);
+        uart_rx_dma_stop();
+        uart_state = UART_SKIP;
+        if (uart_skip == 0)
+            uart_frame_end();
+    }
+}
+#endif
+
+#if !defined(IS31FL3731_COMPATIBLE) && !defined(WS2812_PALETTE_BITS)
+// move LEDs like memmove, source and target may overlap.
+static void pixel_move(uint16_t to, uint16_t from, uint16_t count)
+{
+    uint16_t i, size = count * 3;
+    volatile uint8_t *d = &pixel[to * 3], *s = &pixel[from * 3];
+
+    if (to > from) {
+        for (i = size; i > 0; i--)
+            d[i - 1] = s[i - 1];
+    } else {
+        for (i = 0; i < size; i++)
+            d[i] = s[i];
+    }
+}
+
+static void pixel_reverse(uint16_t led, uint16_t count)
+{
+    volatile uint8_t *a = &pixel[led * 3], *b = &pixel[(led + count) * 3];
+
+    while (a + 3 <= b - 3) {
+        b -= 3;
+        for (uint8_t i = 0; i < 3; i++) {
+            uint8_t t = a[i];
+            a[i] = b[i];
+            b[i] = t;
+        }
+        a += 3;
+    }
+}
+
+static uint8_t add_sat(uint8_t a, uint8_t b)
+{
+    return a > 0xff - b ? 0xff : a + b;
+}
+
+static uint8_t sub_sat(uint8_t a, uint8_t b)
+{
+    return a < b ? 0 : a - b;
+}
+
+// run command from control registers, it may take a few ms for long range
+// so it is not run in I2C interrupt.
+static void cmd_run(void)
+{
+    uint16_t start = ctrl.cmd_start, count = ctrl.cmd_count;
+    uint16_t arg = ctrl.cmd_arg;
+    // WS2812 is GRB.
+    uint8_t grb[3] = {ctrl.cmd_color[1], ctrl.cmd_color[0], ctrl.cmd_color[2]};
+    volatile uint8_t *p;
+    uint16_t i, n, size;
+    uint8_t c = 0;
+
+    if (ctrl.cmd_op == CMD_NONE)
+        return;
+
+    // range out of LEDs is cut to the last LED.
+    if (start >= WS2812_MAX_LEDS || count > WS2812_MAX_LEDS - start) {
+        ctrl.status |= STATUS_CMD_ERROR;
+        count = start >= WS2812_MAX_LEDS ? 0 : WS2812_MAX_LEDS - start;
+    }
+    p = &pixel[start * 3];
+    size = count * 3;
+
+    switch (ctrl.cmd_op) {
+    case CMD_FILL:
+        pixel_fill(start, count, grb[1], grb[0], grb[2]);
+        break;
+    case CMD_COPY:
+        if (arg >= WS2812_MAX_LEDS || count > WS2812_MAX_LEDS - arg) {
+            ctrl.status |= STATUS_CMD_ERROR;
+            count = arg >= WS2812_MAX_LEDS ? 0 : WS2812_MAX_LEDS - arg;
+        }
+        pixel_move(start, arg, count);
+        break;
+    case CMD_ADD:
+        for (i = 0; i < size; i++, c = c < 2 ? c + 1 : 0)
+            p[i] = add_sat(p[i], grb[c]);
+        break;
+    case CMD_SUB:
+        for (i = 0; i < size; i++, c = c < 2 ? c + 1 : 0)
+            p[i] = sub_sat(p[i], grb[c]);
+        break;
+    case CMD_SCALE:
+        // above 256 scales up, saturated.
+        for (i = 0; i < size; i++) {
+            uint32_t v = ((uint32_t)p[i] * arg) >> 8;
+            p[i] = v > 0xff ? 0xff : v;
+        }
+        break;
+    case CMD_SHIFT:
+        // positive moves to the end of the range, negative to the start.
+        n = (int16_t)arg < 0 ? (uint16_t)-arg : arg;
+        if (n > count)
+            n = count;
+        if ((int16_t)arg > 0) {
+            pixel_move(start + n, start, count - n);
+        } else {
+            pixel_move(start, start + n, count - n);
+            start += count - n;
+        }
+        pixel_fill(start, n, grb[1], grb[0], grb[2]);
+        break;
+    case CMD_ROTATE:
+        if (count == 0)
+            break;
+        // rotate to the end by n equals to rotate to the start by count - n.
+        n = (int16_t)arg < 0 ? (uint16_t)-arg : arg;
+        n %= count;
+        if ((int16_t)arg > 0 && n)
+            n = count - n;
+        // rotate to the start by n with three reverses, no extra memory.
+        pixel_reverse(start, n);
+        pixel_reverse(start + n, count - n);
+        pixel_reverse(start, count);
+        break;
+    default:
+        ctrl.status |= STATUS_CMD_ERROR;
+        break;
+    }
+
+    ctrl.cmd_op = CMD_NONE;
+}
+
+// xorshift, random enough for effects.
+static uint32_t fx_random(void)
+{
+    static uint32_t seed = 1;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// color wheel, 0 is red, 85 is green and 170 is blue.
+static void pixel_wheel(uint16_t led, uint8_t pos)
+{
+    uint8_t k;
+
+    if (pos < 85) {
+        k = pos * 3;
+        pixel_set(led, 255 - k, k, 0);
+    } else if (pos < 170) {
+        k = (pos - 85) * 3;
+        pixel_set(led, 0, 255 - k, k);
+    } else {
+        k = (pos - 170) * 3;
+        pixel_set(led, k, 0, 255 - k);
+    }
+}
+
+// run one step of effect when its step time is up, effects keep their
+// state in pixel buffer and phase, so they are free of host traffic.
+static void fx_run(void)
+{
+    static uint32_t last_tick;
+    static uint16_t phase;
+    static uint8_t last_fx;
+    uint16_t start = ctrl.fx_start, count = ctrl.fx_count;
+    uint8_t r = ctrl.fx_color[0], g = ctrl.fx_color[1], b = ctrl.fx_color[2];
+    volatile uint8_t *p;
+    uint16_t i, hue, step;
+    uint8_t level, c;
+
+    if (ctrl.fx != last_fx) {
+        last_fx = ctrl.fx;
+        phase = 0;
+    }
+    if (ctrl.fx == FX_NONE)
+        return;
+
+    if (TICK_NOW() - last_tick < (ctrl.fx_speed + 1) * (FX_STEP_MS * TICK_HZ / 1000))
+        return;
+    last_tick = TICK_NOW();
+
+    // range out of LEDs is cut to the last LED as commands do.
+    if (start >= WS2812_MAX_LEDS)
+        return;
+    if (count == 0 || count > WS2812_MAX_LEDS - start)
+        count = WS2812_MAX_LEDS - start;
+    p = &pixel[start * 3];
+
+    switch (ctrl.fx) {
+    case FX_BREATHE:
+        // triangle wave of 512 steps, squared so it looks even to eyes.
+        level = phase & 0x100 ? 0xff - (phase & 0xff) : phase & 0xff;
+        level = (level * level) >> 8;
+        pixel_fill(start, count, (r * level) >> 8, (g * level) >> 8,
+                   (b * level) >> 8);
+        phase += 2;
+        break;
+    case FX_RAINBOW:
+        // one wheel over the range, moves one step each time.
+        hue = phase << 8;
+        step = 0xffff / count;
+        for (i = 0; i < count; i++, hue += step)
+            pixel_wheel(start + i, hue >> 8);
+        phase++;
+        break;
+    case FX_CHASE:
+        for (i = 0, c = phase % 3; i < count; i++, c = c ? c - 1 : 2) {
+            if (c == 0)
+                pixel_set(start + i, r, g, b);
+            else
+                pixel_set(start + i, 0, 0, 0);
+        }
+        phase++;
+        break;
+    case FX_TWINKLE:
+        for (i = 0; i < count * 3; i++)
+            p[i] -= (p[i] >> 3) + (p[i] != 0);
+        if ((fx_random() & 3) == 0)
+            pixel_set(start + fx_random() % count, r, g, b);
+        break;
+    case FX_WIPE:
+        // fill in first count steps, clear in next count steps.
+        if (phase >= count * 2)
+            phase = 0;
+        if (phase < count)
+            pixel_set(start + phase, r, g, b);
+        else
+            pixel_set(start + phase - count, 0, 0, 0);
+        phase++;
+        break;
+    case FX_FIRE:
+        // heat is the red of last step, mix it with random heat.
+        for (i = 0; i < count; i++) {
+            level = (p[i * 3 + 1] + ((fx_random() & 0xff) | 0x40)) >> 1;
+            pixel_set(start + i, level, (level * level) >> 9, 0);
+        }
+        break;
+    default:
+        ctrl.status |= STATUS_CMD_ERROR;
+        ctrl.fx = FX_NONE;
+        return;
+    }
+
+    // show the step in latch mode.
+    spi_commit = 1;
+}
+
+#ifdef WS2812_BACK_BUFFER
+// weight of target after time of a blend lasts ticks, 0-256.
+static uint16_t fade_weight(uint32_t time, uint32_t ticks)
+{
+    uint32_t w;
+
+    if (time >= ticks || ticks < 256)
+        return 256;
+    w = time / (ticks >> 8);
+    return w > 256 ? 256 : w;
+}
+
+// blend is done, target becomes pixel buffer. LEDs show target during the
+// copy, a byte blends to itself once it is copied.
+static void fade_copy(void)
+{
+    uint16_t i;
+
+    fade_w = 256;
+    for (i = 0; i < sizeof(pixel); i++)
+        pixel[i] = target[i];
+    fade_w = 0;
+}
+
+// move crossfade weight by time, SPI blends the two buffers as it sends,
+// so the fade is smooth at any frame rate and pixel buffer keeps the
+// start frame until the fade is done.
+static void fade_run(void)
+{
+    static uint32_t start;
+    static uint8_t fading;
+    uint32_t time, ticks;
+    uint16_t w;
+
+    if (!(ctrl.fade & FADE_START)) {
+        // stopped by host, show pixel buffer again.
+        if (fading) {
+            fading = 0;
+            fade_w = 0;
+            spi_commit = 1;
+        }
+        return;
+    }
+#ifdef WS2812_INTERPOLATE
+    // interpolation owns the blend.
+    if (ctrl.interp & INTERP_ON) {
+        ctrl.status |= STATUS_CMD_ERROR;
+        ctrl.fade = 0;
+        return;
+    }
+#endif
+    if (!fading) {
+        fading = 1;
+        start = TICK_NOW();
+#ifdef WS2812_INTERPOLATE
+        for (uint16_t i = 0; i < sizeof(pixel); i++)
+            target[i] = back[i];
+#endif
+    }
+
+    time = TICK_NOW() - start;
+    ticks = ctrl.fade_ms * (TICK_HZ / 1000);
+    if (time < ticks) {
+        w = fade_weight(time, ticks);
+        if (w != fade_w) {
+            fade_w = w;
+            spi_commit = 1;
+        }
+        return;
+    }
+
+    fade_copy();
+    fading = 0;
+    ctrl.fade = 0;
+    spi_commit = 1;
+}
+#endif
+
+#ifdef WS2812_INTERPOLATE
+// a commit moves the last frame to pixel buffer and the new one to target,
+// then LEDs blend between them in the time between the last two commits.
+// LEDs are one frame behind the host, that is the cost of interpolation.
+static void interp_run(void)
 {
-    if (SPI_I2S_GetITStatus(SPI1, SPI_I2S_IT_TXE)) {
-        // color id range [0:3]: we send color by bit.
-        // color id range [4:84]: we send zero only as reset.
-        if (cid < 4) {
-            SPI1->DATAR = pixel_map[(pixel[pid] >> (cid << 1)) & 3];
+    static uint32_t start, ticks;
+    static uint8_t on;
+    uint32_t now;
+    uint16_t i, w;
 
-            // one color has send to end, move to next color.
-            if (cid == 0) {
-                // if exceed the array size, turn back to begin of the pixels.
-                if (++pid >= sizeof(pixel)) {
-                    pid = 0;
-                    // we need to send reset to leds to show colors.
-                    cid = SPI_RESET_COUNT;
-                } else {
-                    // rearm the color id to send next color.
-                    cid = 4;
-                }
-            }
-        } else {
-            // reset mode, we send two 0 bits only.
-            SPI1->DATAR = 0;
+    if (!(ctrl.interp & INTERP_ON)) {
+        // leave the mode on the newest frame.
+        if (on) {
+            on = 0;
+            fade_copy();
+            spi_commit = 1;
         }
+        frame_commit = 0;
+        return;
+    }
+    on = 1;
 
-        cid--;
+    if (frame_commit) {
+        frame_commit = 0;
+        now = TICK_NOW();
+        ticks = now - start;
+        if (ticks > INTERP_MAX_MS * (TICK_HZ / 1000))
+            ticks = INTERP_MAX_MS * (TICK_HZ / 1000);
+        ctrl.frame_ms = ticks / (TICK_HZ / 1000);
+        start = now;
+        // LEDs show pixel buffer when target is copied.
+        fade_copy();
+        for (i = 0; i < sizeof(pixel); i++)
+            target[i] = back[i];
+    }
+
+    w = fade_weight(TICK_NOW() - start, ticks);
+    if (w != fade_w) {
+        fade_w = w;
+        spi_commit = 1;
     }
 }
+#endif
 
-INTERRUPT void I2C1_EV_IRQHandler(void)
+#ifdef WS2812_TRANSITIONS
+// move every LED in transition table by 1/steps of its distance, the last
+// step lands on the target.
+static void trans_run(void)
 {
-    if (I2C_GetFlagStatus(I2C1, I2C_FLAG_ADDR)) {
-        (volatile void)(I2C1->STAR2); // read to clear flag.
-        // get address, new transfer begin.
-        i2c_reg = i2c_flag = 0;
-    } else if (I2C_GetFlagStatus(I2C1, I2C_FLAG_RXNE)) {
-#ifdef IS31FL3731_COMPATIBLE
-        if (i2c_flag == 0) {
-            i2c_reg = I2C_ReceiveData(I2C1);
-            i2c_flag++;
-        } else if(i2c_reg == 0xfd) {
-            i2c_page = I2C_ReceiveData(I2C1);
-        } else if (i2c_page == 0) {
-            // WS2812 is GRB, but IS31 is RGB, need to convert.
-            uint8_t reg;
-            switch (i2c_reg % 3) {
-            case 0: reg = i2c_reg + 1; break;
-            case 1: reg = i2c_reg - 1; break;
-            case 2: reg = i2c_reg; break;
-            }
-            // offset with IS31 start address.
-            if (i2c_reg >= 0x24) {
-                pixel[reg - 0x24] = I2C_ReceiveData(I2C1);
-            } else {
-                // receive but ignore.
-                I2C_ReceiveData(I2C1);
-            }
-            i2c_reg++;
-        } else {
-            // not page 0, read and ignore to avoid block.
-            I2C_ReceiveData(I2C1);
-        }
-#else
-        switch (i2c_flag) {
-        case 0:   // receive register address high byte.
-            i2c_reg |= (uint16_t)I2C_ReceiveData(I2C1) << 8;
-            i2c_flag++;
-            break;
-        case 1:   // receive register address low byte.
-            i2c_reg |= (uint16_t)I2C_ReceiveData(I2C1);
-            i2c_flag++;
-            break;
-        default:
-            if (i2c_reg < sizeof(pixel)) {
-                pixel[i2c_reg++] = I2C_ReceiveData(I2C1);
-            } else {
-                I2C_ReceiveData(I2C1);
-            }
-            break;
-        }
-#endif
+    static uint32_t last_tick;
+    volatile struct trans *t = trans;
+    volatile uint8_t *p;
+    uint8_t n, c, steps, moved = 0;
+    int16_t d;
+
+    if (TICK_NOW() - last_tick < TRANS_STEP_MS * (TICK_HZ / 1000))
+        return;
+    last_tick = TICK_NOW();
 
-    } else if (I2C_GetFlagStatus(I2C1, I2C_FLAG_TXE)) {
-        I2C_SendData(I2C1, i2c_reg < sizeof(pixel) ? pixel[i2c_reg++] : 0x00);
-    } else if (I2C_GetFlagStatus(I2C1, I2C_FLAG_STOPF)) {
-        I2C1->CTLR1 &= I2C1->CTLR1;
+    for (n = 0; n < WS2812_TRANSITIONS; n++, t++) {
+        steps = t->steps;
+        if (!steps)
+            continue;
+        p = &pixel[t->led * 3];
+        for (c = 0; c < 3; c++) {
+            d = t->grb[c] - p[c];
+            p[c] += d / steps;
+        }
+        // a new entry from I2C may take the slot meanwhile.
+        if (t->steps == steps)
+            t->steps = steps - 1;
+        moved = 1;
     }
+
+    // show the step in latch mode.
+    if (moved)
+        spi_commit = 1;
 }
+#endif
+#endif
 
 void spi_init(void)
 {
@@ -152,6 +1983,91 @@ void spi_init(void)
     SPI_Cmd(SPI1, ENABLE);
 }
 
+// config block at start of config page, it is used only when version,
+// size and CRC-8 are right, erased flash or another layout means default.
+// a new field changes CONFIG_VERSION. program flash uses address of the
+// alias region.
+#define CONFIG_VERSION      1
+struct config {
+    uint8_t version;        // CONFIG_VERSION.
+    uint8_t size;           // sizeof(struct config).
+    uint8_t i2c_addr;
+    uint8_t i2c_addr2;
+    uint8_t scenes;         // bit n is 0 when scene slot n is saved.
+    uint8_t order;
+    uint16_t led_count;
+    uint8_t latch;          // latch mode at power on.
+    uint8_t crc_mode;       // CRC mode at power on.
+    uint8_t reserved;
+    uint8_t crc;            // CRC-8 of bytes before.
+};
+
+#define FLASH_PAGE_SIZE     64
+static const union {
+    struct config config;
+    uint32_t word[FLASH_PAGE_SIZE / 4];
+} config_page __attribute__((aligned(FLASH_PAGE_SIZE))) = {
+    .word = {[0 ... FLASH_PAGE_SIZE / 4 - 1] = 0xffffffff}
+};
+#define CONFIG              ((const volatile uint8_t *)&config_page.config)
+
+#define I2C_ADDR_VALID(a)   ((a) >= 0x08 && (a) <= 0x77)
+
+static uint8_t config_crc(const struct config *config)
+{
+    uint8_t crc = 0;
+
+    for (uint8_t i = 0; i < offsetof(struct config, crc); i++)
+        crc = crc8(crc, ((const uint8_t *)config)[i]);
+    return crc;
+}
+
+// copy config block from flash, or defaults when it is not good. there is
+// no RAM to keep it, it is read again when needed.
+static void config_read(struct config *config)
+{
+    for (uint8_t i = 0; i < sizeof(*config); i++)
+        ((uint8_t *)config)[i] = CONFIG[i];
+
+    if (config->version != CONFIG_VERSION || config->size != sizeof(*config) ||
+        config->crc != config_crc(config) || !I2C_ADDR_VALID(config->i2c_addr) ||
+        config->order >= ORDER_COUNT) {
+        *config = (struct config){
+            .version = CONFIG_VERSION,
+            .size = sizeof(*config),
+            .i2c_addr = I2C_ADDRESS,
+            .scenes = 0xff,
+        };
+    }
+}
+
+static void config_load(void)
+{
+    struct config config;
+
+    config_read(&config);
+    ctrl.i2c_addr = config.i2c_addr;
+    ctrl.i2c_addr2 = config.i2c_addr2;
+    ctrl.order = config.order;
+    ctrl.led_count = config.led_count;
+    ctrl.latch = config.latch & LATCH_ENABLE;
+    ctrl.crc_mode = config.crc_mode & CRC_ENABLE;
+    order_apply();
+    led_count_apply();
+}
+
+// use saved addresses of config block, registers written by host change
+// nothing until they are checked and saved.
+static void i2c_set_address(void)
+{
+    struct config config;
+
+    config_read(&config);
+    I2C1->OADDR1 = I2C_AcknowledgedAddress_7bit | config.i2c_addr << 1;
+    I2C_OwnAddress2Config(I2C1, config.i2c_addr2 << 1);
+    I2C_DualAddressCmd(I2C1, config.i2c_addr2 ? ENABLE : DISABLE);
+}
+
 void i2c_init(void)
 {
     GPIO_InitTypeDef  GPIO_InitStructure;
@@ -168,13 +2084,18 @@ void i2c_init(void)
     GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
     GPIO_Init(GPIOC, &GPIO_InitStructure);
 
-    I2C_InitTSturcture.I2C_ClockSpeed = 400000;
+    I2C_InitTSturcture.I2C_ClockSpeed = I2C_CLOCK_SPEED;
     I2C_InitTSturcture.I2C_Mode = I2C_Mode_I2C;
+#if I2C_CLOCK_SPEED > 400000
+    I2C_InitTSturcture.I2C_DutyCycle = I2C_DutyCycle_16_9;
+#else
     I2C_InitTSturcture.I2C_DutyCycle = I2C_DutyCycle_2;
+#endif
     I2C_InitTSturcture.I2C_Ack = I2C_Ack_Enable;
     I2C_InitTSturcture.I2C_AcknowledgedAddress = I2C_AcknowledgedAddress_7bit;
     I2C_InitTSturcture.I2C_OwnAddress1 = I2C_ADDRESS << 1;
     I2C_Init(I2C1, &I2C_InitTSturcture);
+    i2c_set_address();
 
     NVIC_InitStructure.NVIC_IRQChannel = I2C1_EV_IRQn;
     NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
@@ -184,24 +2105,589 @@ void i2c_init(void)
     NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
     NVIC_Init(&NVIC_InitStructure);
 
-    I2C_ITConfig(I2C1, I2C_IT_BUF | I2C_IT_EVT, ENABLE);
+#ifndef IS31FL3731_COMPATIBLE
+    DMA_InitTypeDef DMA_InitStructure;
+
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+
+    // memory address and size are set for every transfer.
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&I2C1->DATAR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)pixel;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+    DMA_InitStructure.DMA_BufferSize = sizeof(pixel);
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(I2C_RX_DMA, &DMA_InitStructure);
+    DMA_ITConfig(I2C_RX_DMA, DMA_IT_TC, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel7_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
+
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+    DMA_Init(I2C_TX_DMA, &DMA_InitStructure);
+    DMA_ITConfig(I2C_TX_DMA, DMA_IT_TC, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel6_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
+#endif
+
+    // keep clock stretching, SCL is only held low when interrupt or DMA
+    // falls behind and data register is not served in time.
+    I2C_StretchClockCmd(I2C1, ENABLE);
+    I2C_GeneralCallCmd(I2C1, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = I2C1_ER_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
+
+    I2C_ITConfig(I2C1, I2C_IT_BUF | I2C_IT_EVT | I2C_IT_ERR, ENABLE);
     I2C_Cmd(I2C1, ENABLE);
 }
 
+// transfer to this device makes no progress for a long time, host may
+// have gone in the middle of it with SDA held low by us. reset I2C to
+// release the bus. a long transfer to another device on the bus is not a
+// stall, only time while addressed counts.
+#define I2C_STALL_MS        25
+
+static void i2c_poll(void)
+{
+    static uint32_t last_tick;
+    static uint16_t last_progress;
+    uint16_t progress = i2c_events;
+
+#ifndef IS31FL3731_COMPATIBLE
+    // DMA transfer makes progress without interrupt.
+    progress += DMA_GetCurrDataCounter(I2C_RX_DMA) +
+                DMA_GetCurrDataCounter(I2C_TX_DMA);
+#endif
+    if (!i2c_addressed || !(I2C1->STAR2 & I2C_STAR2_BUSY) ||
+        progress != last_progress) {
+        last_progress = progress;
+        last_tick = TICK_NOW();
+        return;
+    }
+
+    if (TICK_NOW() - last_tick > I2C_STALL_MS * (TICK_HZ / 1000)) {
+        i2c_resync();
+        RCC_APB1PeriphResetCmd(RCC_APB1Periph_I2C1, ENABLE);
+        RCC_APB1PeriphResetCmd(RCC_APB1Periph_I2C1, DISABLE);
+        i2c_init();
+        ctrl.bus_resets++;
+        last_tick = TICK_NOW();
+    }
+}
+
+#ifdef USART_BAUD
+void uart_init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    USART_InitTypeDef USART_InitStructure;
+    DMA_InitTypeDef DMA_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOD, ENABLE);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART1, ENABLE);
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+
+    // USART1 RX => PD6
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_6;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IPU;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_Init(GPIOD, &GPIO_InitStructure);
+
+    USART_InitStructure.USART_BaudRate = USART_BAUD;
+    USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+    USART_InitStructure.USART_StopBits = USART_StopBits_1;
+    USART_InitStructure.USART_Parity = USART_Parity_No;
+    USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+    USART_InitStructure.USART_Mode = USART_Mode_Rx;
+    USART_Init(USART1, &USART_InitStructure);
+
+    // memory address and size are set for every frame.
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USART1->DATAR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)pixel;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+    DMA_InitStructure.DMA_BufferSize = sizeof(pixel);
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(UART_RX_DMA, &DMA_InitStructure);
+    DMA_ITConfig(UART_RX_DMA, DMA_IT_TC, ENABLE);
+
+    // same priority as I2C, SPI interrupt must not wait.
+    NVIC_InitStructure.NVIC_IRQChannel = USART1_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 8;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel5_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
+
+    USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
+    USART_Cmd(USART1, ENABLE);
+}
+
+// host stops in the middle of a frame, drop it or the next header would
+// be taken as LED data.
+#define UART_STALL_MS       50
+
+static void uart_poll(void)
+{
+    static uint32_t last_tick;
+    static uint16_t last_count;
+    uint16_t count = DMA_GetCurrDataCounter(UART_RX_DMA);
+
+    if (uart_state != UART_DATA || count != last_count) {
+        last_count = count;
+        last_tick = TICK_NOW();
+        return;
+    }
+
+    if (TICK_NOW() - last_tick > UART_STALL_MS * (TICK_HZ / 1000)) {
+        uart_rx_dma_stop();
+        uart_resync();
+    }
+}
+#endif
+
+void systick_init(void)
+{
+    // count up from 0 at HCLK/8 and never reload, no interrupt.
+    SysTick->CTLR = 0;
+    SysTick->CNT = 0;
+    SysTick->CMP = 0xffffffff;
+    SysTick->CTLR = 1;
+}
+
+#ifdef UNITTEST_LED_BREATH
+static void delay_ms(uint32_t ms)
+{
+    uint32_t start = TICK_NOW();
+    while (TICK_NOW() - start < ms * (TICK_HZ / 1000));
+}
+#endif
+
+// write config to config page, CPU stalls while flash is busy.
+static void config_write(struct config *config)
+{
+    uint32_t page = FLASH_BASE + (uint32_t)&config_page;
+    uint8_t *p = (uint8_t *)config;
+
+    config->crc = config_crc(config);
+    FLASH_Unlock_Fast();
+    FLASH_ErasePage_Fast(page);
+    FLASH_BufReset();
+    for (int i = 0; i < FLASH_PAGE_SIZE; i += 4, p += 4)
+        FLASH_BufLoad(page + i, i >= sizeof(*config) ? 0xffffffff :
+                      p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+    FLASH_ProgramPage_Fast(page);
+    FLASH_Lock_Fast();
+}
+
+// save config registers to config page and use them once the bus is idle.
+static void config_poll(void)
+{
+    struct config config;
+
+    if (ctrl.cfg_save != CONFIG_SAVE || (I2C1->STAR2 & I2C_STAR2_BUSY))
+        return;
+
+    config_read(&config);
+    if (!I2C_ADDR_VALID(ctrl.i2c_addr) ||
+        (ctrl.i2c_addr2 && !I2C_ADDR_VALID(ctrl.i2c_addr2))) {
+        ctrl.status |= STATUS_CFG_ERROR;
+        ctrl.i2c_addr = config.i2c_addr;
+        ctrl.i2c_addr2 = config.i2c_addr2;
+        ctrl.cfg_save = 0;
+        return;
+    }
+
+    config.i2c_addr = ctrl.i2c_addr;
+    config.i2c_addr2 = ctrl.i2c_addr2;
+    config.order = ctrl.order;
+    config.led_count = ctrl.led_count;
+    config.latch = ctrl.latch;
+    config.crc_mode = ctrl.crc_mode;
+    config_write(&config);
+    i2c_set_address();
+    ctrl.cfg_save = 0;
+}
+
+#ifdef SCENE_SLOTS
+#if SCENE_SLOTS > 8
+#error "SCENE_SLOTS is up to 8."
+#endif
+// pixel buffer in whole flash pages.
+#define SCENE_SIZE          ((sizeof(pixel) + FLASH_PAGE_SIZE - 1) & \
+                             ~(FLASH_PAGE_SIZE - 1))
+static const uint8_t scene_flash[SCENE_SLOTS][SCENE_SIZE]
+__attribute__((aligned(FLASH_PAGE_SIZE))) = {
+    [0 ... SCENE_SLOTS - 1] = {[0 ... SCENE_SIZE - 1] = 0xff}
+};
+#define SCENE(slot)         ((const volatile uint8_t *)scene_flash[slot])
+
+static void scene_load(uint8_t slot)
+{
+    for (uint16_t i = 0; i < sizeof(pixel); i++)
+        pixel[i] = SCENE(slot)[i];
+    spi_commit = 1;
+}
+
+static void scene_save(uint8_t slot)
+{
+    uint32_t page = FLASH_BASE + (uint32_t)scene_flash[slot];
+    uint32_t word;
+    uint16_t n;
+
+    FLASH_Unlock_Fast();
+    for (n = 0; n < SCENE_SIZE; n += FLASH_PAGE_SIZE, page += FLASH_PAGE_SIZE) {
+        FLASH_ErasePage_Fast(page);
+        FLASH_BufReset();
+        for (int i = 0; i < FLASH_PAGE_SIZE; i += 4) {
+            word = 0;
+            for (int b = 3; b >= 0; b--) {
+                word <<= 8;
+                if (n + i + b < sizeof(pixel))
+                    word |= pixel[n + i + b];
+                else
+                    word |= 0xff;
+            }
+            FLASH_BufLoad(page + i, word);
+        }
+        FLASH_ProgramPage_Fast(page);
+    }
+    FLASH_Lock_Fast();
+}
+
+// light up with the default scene before host comes.
+static void scene_boot(void)
+{
+    struct config config;
+
+    config_read(&config);
+    if (!(config.scenes & 1))
+        scene_load(0);
+}
+
+// run scene operation, flash writes wait until the bus is idle.
+static void scene_poll(void)
+{
+    uint8_t slot = ctrl.scene_slot;
+    struct config config;
+
+    if (ctrl.scene_op == SCENE_NONE)
+        return;
+    if (ctrl.scene_op != SCENE_LOAD && (I2C1->STAR2 & I2C_STAR2_BUSY))
+        return;
+
+    config_read(&config);
+    if (slot >= SCENE_SLOTS) {
+        ctrl.status |= STATUS_CMD_ERROR;
+    } else if (ctrl.scene_op == SCENE_LOAD) {
+        if ((config.scenes >> slot) & 1)
+            ctrl.status |= STATUS_CMD_ERROR;
+        else
+            scene_load(slot);
+    } else if (ctrl.scene_op == SCENE_SAVE) {
+        scene_save(slot);
+        if ((config.scenes >> slot) & 1) {
+            config.scenes &= ~(1 << slot);
+            config_write(&config);
+        }
+    } else if (ctrl.scene_op == SCENE_DELETE) {
+        if (!((config.scenes >> slot) & 1)) {
+            config.scenes |= 1 << slot;
+            config_write(&config);
+        }
+    } else {
+        ctrl.status |= STATUS_CMD_ERROR;
+    }
+    ctrl.scene_op = SCENE_NONE;
+}
+#endif
+
+#ifdef CLIP_FLASH_SIZE
+static const uint8_t clip_flash[CLIP_FLASH_SIZE]
+__attribute__((aligned(FLASH_PAGE_SIZE))) = {
+    [0 ... CLIP_FLASH_SIZE - 1] = 0xff
+};
+#define CLIP                ((const volatile uint8_t *)clip_flash)
+// clip data follows its size.
+#define CLIP_SIZE           (CLIP[0] | CLIP[1] << 8)
+#define CLIP_DATA           2
+
+// save pages from pixel buffer to clip flash once the bus is idle, the
+// clip stops as its flash changes.
+static void clip_save(void)
+{
+    uint32_t page = FLASH_BASE + (uint32_t)clip_flash +
+                    ctrl.clip_page * FLASH_PAGE_SIZE;
+    volatile uint8_t *p = pixel;
+    uint8_t n;
+
+    if (ctrl.clip_save != CONFIG_SAVE || (I2C1->STAR2 & I2C_STAR2_BUSY))
+        return;
+
+    if (ctrl.clip_pages * FLASH_PAGE_SIZE > sizeof(pixel) ||
+        ctrl.clip_page + ctrl.clip_pages > CLIP_FLASH_SIZE / FLASH_PAGE_SIZE) {
+        ctrl.status |= STATUS_CMD_ERROR;
+        ctrl.clip_save = 0;
+        return;
+    }
+    ctrl.clip = 0;
+
+    FLASH_Unlock_Fast();
+    for (n = 0; n < ctrl.clip_pages; n++, page += FLASH_PAGE_SIZE) {
+        FLASH_ErasePage_Fast(page);
+        FLASH_BufReset();
+        for (int i = 0; i < FLASH_PAGE_SIZE; i += 4, p += 4)
+            FLASH_BufLoad(page + i, p[0] | p[1] << 8 | p[2] << 16 |
+                          (uint32_t)p[3] << 24);
+        FLASH_ProgramPage_Fast(page);
+    }
+    FLASH_Lock_Fast();
+
+    ctrl.clip_save = 0;
+}
+
+// decode one frame from clip offset pos to pixel buffer, return offset of
+// the next frame.
+static uint16_t clip_frame(uint16_t pos, uint16_t end)
+{
+    uint16_t led = 0;
+    uint8_t run;
+
+    while (pos < end) {
+        run = CLIP[pos++];
+        if (run == 0)
+            break;
+        if (run & 0x80) {
+            led += (run & 0x7f) + 1;
+        } else if (pos + 3 <= end) {
+            pixel_fill(led, run, CLIP[pos], CLIP[pos + 1], CLIP[pos + 2]);
+            led += run;
+            pos += 3;
+        } else {
+            pos = end;
+        }
+    }
+    return pos;
+}
+
+// show next frame of clip every 1/clip_fps second.
+static void clip_run(void)
+{
+    static uint32_t last_tick;
+    static uint16_t pos;
+    static uint8_t playing;
+    uint16_t end = CLIP_DATA + CLIP_SIZE;
+
+    if (!(ctrl.clip & CLIP_PLAY)) {
+        playing = 0;
+        return;
+    }
+    if (!playing) {
+        // erased flash(size 0xffff) has no clip.
+        if (CLIP_SIZE > CLIP_FLASH_SIZE - CLIP_DATA) {
+            ctrl.status |= STATUS_CMD_ERROR;
+            ctrl.clip = 0;
+            return;
+        }
+        playing = 1;
+        pos = CLIP_DATA;
+    } else if (TICK_NOW() - last_tick < TICK_HZ / (ctrl.clip_fps ? ctrl.clip_fps : 1)) {
+        return;
+    }
+    last_tick = TICK_NOW();
+
+    if (pos >= end) {
+        if (!(ctrl.clip & CLIP_LOOP)) {
+            ctrl.clip = 0;
+            playing = 0;
+            return;
+        }
+        pos = CLIP_DATA;
+    }
+    pos = clip_frame(pos, end);
+
+    // show the frame in latch mode.
+    spi_commit = 1;
+}
+#endif
+
+#ifdef IS31FL3731_COMPATIBLE
+// blink bits of the frame are for RGB order of PWM registers, reorder them
+// to GRB of pixel buffer.
+static void is31_blink_update(uint8_t frame_id)
+{
+    uint8_t n, g, on;
+
+    for (n = 0; n < IS31_BLINK_SIZE * 8; n++) {
+        on = frame_id < IS31_FRAMES &&
+             (is31_blink[frame_id][n >> 3] >> (n & 7)) & 1;
+        switch (n % 3) {
+        case 0: g = n + 1; break;
+        case 1: g = n - 1; break;
+        default: g = n; break;
+        }
+        if (on)
+            blink_mask[g >> 3] |= 1 << (g & 7);
+        else
+            blink_mask[g >> 3] &= ~(1 << (g & 7));
+    }
+}
+
+// breath level, fade in, fade out and then stay dark, repeat.
+static uint8_t is31_breath(void)
+{
+    static uint32_t start;
+    uint8_t breath1 = is31_func[IS31_BREATH1];
+    uint8_t breath2 = is31_func[IS31_BREATH2];
+    uint32_t fade_in = (26 * TICK_HZ / 1000) << (breath1 & 0x07);
+    uint32_t fade_out = (26 * TICK_HZ / 1000) << ((breath1 >> 4) & 0x07);
+    uint32_t dark = (35 * TICK_HZ / 10000) << (breath2 & 0x07);
+    uint32_t t = TICK_NOW() - start;
+    uint32_t level;
+
+    if (!(breath2 & IS31_BREATH_EN)) {
+        start = TICK_NOW();
+        return 0xff;
+    }
+
+    // ticks are shifted down first, a ramp of 3.3s x 255 is beyond 32 bits.
+    if (t < fade_in) {
+        level = (t >> 8) * 255 / (fade_in >> 8);
+    } else if (t < fade_in + fade_out) {
+        level = 255 - ((t - fade_in) >> 8) * 255 / (fade_out >> 8);
+    } else {
+        if (t >= fade_in + fade_out + dark)
+            start = TICK_NOW();
+        level = 0;
+    }
+    // square the linear ramp, brightness looks even to eyes.
+    return level * level / 255;
+}
+
+// blink off phase, half of blink period.
+static uint8_t is31_blink_phase(void)
+{
+    uint8_t display = is31_func[IS31_DISPLAY];
+    uint32_t period = (display & 0x07) ? (display & 0x07) : 1;
+
+    if (!(display & IS31_BLINK_EN))
+        return 0;
+    period *= 27 * TICK_HZ / 100;
+    return TICK_NOW() % period >= period / 2;
+}
+
+// select frame to show by display mode, auto play moves to next frame
+// every frame delay and stops at last frame after the loops.
+static void is31_poll(void)
+{
+    static uint32_t last_tick;
+    static uint8_t loops, done;
+    uint8_t config = is31_func[IS31_CONFIG];
+    uint8_t start = config & 0x07;
+    uint8_t frame_id = is31_state & 0x07;
+
+    if (is31_restart) {
+        is31_restart = 0;
+        loops = done = 0;
+        frame_id = start;
+        last_tick = TICK_NOW();
+    }
+
+    if ((config & IS31_MODE_MASK) == IS31_MODE_AUTO) {
+        uint8_t frames = is31_func[IS31_AUTO_PLAY1] & 0x07;
+        uint8_t count = (is31_func[IS31_AUTO_PLAY1] >> 4) & 0x07;
+        uint8_t delay = is31_func[IS31_AUTO_PLAY2] & 0x3f;
+
+        if (frames == 0)
+            frames = 8;
+        if (delay == 0)
+            delay = 64;
+
+        if (!done && TICK_NOW() - last_tick >= delay * (11 * TICK_HZ / 1000)) {
+            uint8_t next = (frame_id + 1 - start) & 0x07;
+
+            last_tick = TICK_NOW();
+            if (next && next < frames) {
+                frame_id = (frame_id + 1) & 0x07;
+            } else if (count && ++loops >= count) {
+                done = 1;
+                is31_state |= IS31_FRAME_INT;
+            } else {
+                frame_id = start;
+            }
+        }
+    } else {
+        // picture mode, audio frame play is not supported and shows the
+        // picture frame too.
+        frame_id = is31_func[IS31_PICTURE] & 0x07;
+    }
+
+    if (is31_blink_dirty || frame_id != (is31_state & 0x07)) {
+        is31_blink_dirty = 0;
+        is31_blink_update(frame_id);
+    }
+
+    is31_state = (is31_state & ~0x07) | frame_id;
+    if (frame_id < IS31_FRAMES)
+        is31_show = frame[frame_id];
+    is31_level = frame_id < IS31_FRAMES &&
+                 (is31_func[IS31_SHUTDOWN] & 0x01) ? is31_breath() : 0x00;
+    is31_blink_off = is31_blink_phase();
+}
+#endif
+
+#ifndef IS31FL3731_COMPATIBLE
+// update received data rate once a second.
+static void rate_poll(void)
+{
+    static uint32_t last_tick, last_bytes;
+    uint32_t bytes;
+
+    if (TICK_NOW() - last_tick < TICK_HZ)
+        return;
+    last_tick += TICK_HZ;
+
+    bytes = ctrl.rx_bytes;
+    ctrl.rx_rate = bytes - last_bytes;
+    last_bytes = bytes;
+}
+#endif
+
 int main(void)
 {
     SystemCoreClockUpdate();
-    Delay_Init();
+    systick_init();
+    config_load();
+#ifdef SCENE_SLOTS
+    scene_boot();
+#endif
 
     spi_init();
     i2c_init();
+#ifdef USART_BAUD
+    uart_init();
+#endif
 
 #ifdef UNITTEST_LED_BREATH
     uint8_t count = 0, dir = 0, color = 0;
     while (1) {
         for(int i = color; i < sizeof(pixel); i += 3)
             pixel[i] = count;
-        Delay_Ms(10);
+        delay_ms(10);
 
         if (dir) {
             if (++count == 0) {
@@ -217,7 +2703,38 @@ int main(void)
         }
     }
 #else
-    while (1);
+    while (1) {
+        i2c_poll();
+        config_poll();
+#ifdef SCENE_SLOTS
+        scene_poll();
+#endif
+#ifdef USART_BAUD
+        uart_poll();
+#endif
+#ifdef IS31FL3731_COMPATIBLE
+        is31_poll();
+#else
+        rate_poll();
+#ifndef WS2812_PALETTE_BITS
+        cmd_run();
+        fx_run();
+#endif
+#ifdef WS2812_BACK_BUFFER
+        fade_run();
+#endif
+#ifdef WS2812_INTERPOLATE
+        interp_run();
+#endif
+#ifdef CLIP_FLASH_SIZE
+        clip_save();
+        clip_run();
+#endif
+#ifdef WS2812_TRANSITIONS
+        trans_run();
+#endif
+#endif
+    }
 #endif
 }
 
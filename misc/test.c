@@ -6,6 +6,7 @@
 #include <string.h>
 #include <memory.h>
 #include <unistd.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
 #define MAX_I2C_PACK 16         // V7B: 16, MPRO: 59
@@ -81,7 +82,7 @@ int v2s_i2c_write_reg16(uint8_t addr, uint16_t reg, uint8_t *d, uint8_t size)
     return size;
 }
 
-int v2s_i2c_write_reg16s(uint8_t addr, uint16_t reg, uint8_t *d, uint8_t size)
+int v2s_i2c_write_reg16s(uint8_t addr, uint16_t reg, uint8_t *d, uint16_t size)
 {
     int used = 0;
     while (used < size) {
@@ -89,6 +90,337 @@ int v2s_i2c_write_reg16s(uint8_t addr, uint16_t reg, uint8_t *d, uint8_t size)
         v2s_i2c_write_reg16(addr, reg + used, d + used, cur_size);
         used += cur_size;
     }
+    return used;
+}
+
+// write without register address, for stream mode. bytes of register
+// address are free for data, size is up to MAX_I2C_PACK + 2.
+int v2s_i2c_write(uint8_t addr, uint8_t *d, uint8_t size)
+{
+    uint8_t buf[64] = {0};
+    int r;
+
+    if (size > MAX_I2C_PACK + 2)
+        return -1;
+
+    buf[0] = addr;
+    buf[1] = size;
+    buf[2] = 0;
+    memcpy(buf + 3, d, size);
+
+    r = libusb_control_transfer(handle, 0x40, 0xb5, 0, 0, buf, 3 + size, 200);
+    if (r < 0)
+        return r;
+
+    r = libusb_control_transfer(handle, 0xc0, 0xb6, 0, 0, buf, 1, 200);
+    if (r < 0)
+        return r;
+
+    return size;
+}
+
+// send frame in stream mode, enter at pixel buffer offset 0, send payload
+// only writes and leave by a write without data, so register reads after
+// it are not taken as pixel data.
+int v2s_led_stream(uint8_t addr, uint8_t *d, uint16_t size)
+{
+    int used = 0;
+
+    v2s_i2c_write_reg16(addr, 0x6000, NULL, 0);
+    while (used < size) {
+        int cur_size = min(size - used, MAX_I2C_PACK + 2);
+        v2s_i2c_write(addr, d + used, cur_size);
+        used += cur_size;
+    }
+    v2s_i2c_write(addr, NULL, 0);
+    return used;
+}
+
+// pack RGB colors to RGB565 and write them to LEDs start from led.
+int v2s_led_write_rgb565(uint8_t addr, uint16_t led, uint8_t *rgb, uint16_t count)
+{
+    uint8_t d[count * 2];
+
+    for (int i = 0; i < count; i++) {
+        uint8_t *c = rgb + i * 3;
+        d[i * 2] = (c[0] & 0xf8) | (c[1] >> 5);
+        d[i * 2 + 1] = ((c[1] << 3) & 0xe0) | (c[2] >> 3);
+    }
+
+    return v2s_i2c_write_reg16s(addr, 0x1000 + led * 2, d, count * 2);
+}
+
+// encode RGB colors to RLE runs(count, R, G, B) and write them to LEDs start
+// from led. every transfer carries whole runs and is addressed to the LED
+// where its first run begins. returns bytes sent on I2C bus.
+int v2s_led_write_rle(uint8_t addr, uint16_t led, uint8_t *rgb, uint16_t count)
+{
+    uint8_t d[MAX_I2C_PACK];
+    int size = 0, sent = 0;
+    uint16_t start = led;
+
+    for (int i = 0; i < count;) {
+        int n = 1;
+        while (i + n < count && n < 0x7f && !memcmp(rgb + i * 3, rgb + (i + n) * 3, 3))
+            n++;
+
+        if (size + 4 > MAX_I2C_PACK) {
+            v2s_i2c_write_reg16(addr, 0x4000 + start, d, size);
+            sent += size + 2;
+            start = led + i;
+            size = 0;
+        }
+
+        d[size++] = n;
+        memcpy(d + size, rgb + i * 3, 3);
+        size += 3;
+        i += n;
+    }
+
+    if (size) {
+        v2s_i2c_write_reg16(addr, 0x4000 + start, d, size);
+        sent += size + 2;
+    }
+    return sent;
+}
+
+// update scattered LEDs in one transfer, every entry is LED index(high byte
+// first) and R, G, B. entries are applied together when the transfer stops.
+int v2s_led_write_sparse(uint8_t addr, uint16_t *leds, uint8_t *rgb, uint8_t count)
+{
+    uint8_t d[MAX_I2C_PACK];
+
+    if (count * 5 > MAX_I2C_PACK)
+        return -1;         // required data is too much.
+
+    for (int i = 0; i < count; i++) {
+        d[i * 5] = leds[i] >> 8;
+        d[i * 5 + 1] = leds[i] & 0xff;
+        memcpy(d + i * 5 + 2, rgb + i * 3, 3);
+    }
+
+    return v2s_i2c_write_reg16(addr, 0x5000, d, count * 5);
+}
+
+// run a command on LEDs [start, start + count), parameters and command are
+// written in one transfer, command starts when its last byte is written.
+// op: 1 fill, 2 copy from arg, 3 add, 4 sub, 5 scale by arg / 256,
+//     6 shift by arg(signed) and fill the gap, 7 rotate by arg(signed).
+int v2s_led_command(uint8_t addr, uint8_t op, uint16_t start, uint16_t count,
+                    uint16_t arg, uint8_t r, uint8_t g, uint8_t b)
+{
+    uint8_t d[10] = {start & 0xff, start >> 8, count & 0xff, count >> 8,
+                     arg & 0xff, arg >> 8, r, g, b, op};
+
+    return v2s_i2c_write_reg16(addr, 0x8002, d, sizeof(d));
+}
+
+// latch mode holds LEDs on last frame until a commit, general call commits
+// every controller on the bus at the same time.
+int v2s_led_latch(uint8_t addr, uint8_t enable)
+{
+    return v2s_i2c_write_reg16(addr, 0x801e, &enable, 1);
+}
+
+// CRC-8 of SMBus PEC, poly 0x07.
+static uint8_t crc8(uint8_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (int i = 0; i < 8; i++)
+        crc = crc & 0x80 ? crc << 1 ^ 0x07 : crc << 1;
+    return crc;
+}
+
+// write with CRC in CRC mode(bit 0 of register 0x8022), size is up to
+// MAX_I2C_PACK - 1. returns 0 when device takes the data, 1 when device
+// drops it, check a group of writes by reading status once after them.
+int v2s_led_write_crc(uint8_t addr, uint16_t reg, uint8_t *d, uint8_t size)
+{
+    uint8_t buf[MAX_I2C_PACK], status = 1;
+    uint8_t crc = crc8(crc8(crc8(0, addr << 1), reg >> 8), reg & 0xff);
+
+    if (size + 1 > MAX_I2C_PACK)
+        return -1;
+
+    for (int i = 0; i < size; i++)
+        crc = crc8(crc, buf[i] = d[i]);
+    buf[size] = crc;
+
+    v2s_i2c_write_reg16(addr, reg, buf, size + 1);
+    v2s_i2c_read_reg16(addr, 0x8023, &status, 1);
+    return status;
+}
+
+// run effect on LEDs [start, start + count)(count 0 to the last LED), step
+// every (speed + 1) x 4ms. fx: 0 stop, 1 breathe, 2 rainbow, 3 chase,
+// 4 twinkle, 5 color wipe, 6 fire.
+int v2s_led_effect(uint8_t addr, uint8_t fx, uint16_t start, uint16_t count,
+                   uint8_t speed, uint8_t r, uint8_t g, uint8_t b)
+{
+    uint8_t d[9] = {speed, start & 0xff, start >> 8, count & 0xff, count >> 8,
+                    r, g, b, fx};
+
+    return v2s_i2c_write_reg16(addr, 0x802b, d, sizeof(d));
+}
+
+// upload target frame to back buffer and fade to it in ms.
+int v2s_led_crossfade(uint8_t addr, uint8_t *frame, uint16_t size, uint16_t ms)
+{
+    uint8_t d[3] = {ms & 0xff, ms >> 8, 1};
+
+    v2s_i2c_write_reg16s(addr, 0xa000, frame, size);
+    return v2s_i2c_write_reg16(addr, 0x8034, d, sizeof(d));
+}
+
+// fade one LED to a color in steps x 10ms.
+int v2s_led_transition(uint8_t addr, uint16_t led, uint8_t r, uint8_t g,
+                       uint8_t b, uint8_t steps)
+{
+    uint8_t d[6] = {led >> 8, led & 0xff, r, g, b, steps};
+
+    return v2s_i2c_write_reg16(addr, 0x9000, d, sizeof(d));
+}
+
+// interpolation mode: upload a frame to back buffer and commit it in
+// latch mode, LEDs move to it in the time since the last commit.
+int v2s_led_interp_frame(uint8_t addr, uint8_t *frame, uint16_t size)
+{
+    uint8_t d = 3;
+
+    v2s_i2c_write_reg16s(addr, 0xa000, frame, size);
+    return v2s_i2c_write_reg16(addr, 0x801e, &d, 1);
+}
+
+// save a clip(RLE frames, every frame ends by 0x00) to clip flash, pages
+// go through pixel buffer in latch mode, CLIP_CHUNK fits every LED count.
+// latch mode is kept, so LEDs show the old frame until the clip plays.
+#define CLIP_CHUNK          (7 * 64)
+int v2s_led_clip_save(uint8_t addr, uint8_t *clip, uint16_t size)
+{
+    static uint8_t d[CLIP_CHUNK];
+    uint8_t cmd[3], busy;
+    int pos = -2, page = 0;
+
+    v2s_led_latch(addr, 1);
+    while (pos < size) {
+        int n = 0;
+        memset(d, 0xff, sizeof(d));
+        // size comes first.
+        for (; n < CLIP_CHUNK && pos < size; n++, pos++)
+            d[n] = pos == -2 ? size & 0xff : pos == -1 ? size >> 8 : clip[pos];
+        n = (n + 63) / 64;
+        v2s_i2c_write_reg16s(addr, 0x0000, d, n * 64);
+
+        cmd[0] = page;
+        cmd[1] = n;
+        cmd[2] = 0xa5;
+        v2s_i2c_write_reg16(addr, 0x803a, cmd, sizeof(cmd));
+        do {
+            usleep(1000);
+            v2s_i2c_read_reg16(addr, 0x803c, &busy, 1);
+        } while (busy);
+        page += n;
+    }
+    return 0;
+}
+
+// play clip at fps, once or in loop.
+int v2s_led_clip_play(uint8_t addr, uint8_t fps, int loop)
+{
+    uint8_t d[2] = {fps, loop ? 3 : 1};
+
+    return v2s_i2c_write_reg16(addr, 0x803d, d, sizeof(d));
+}
+
+// scene slot operation, 0xa5 save, 1 load, 2 delete. slot 0 is shown at
+// power on.
+int v2s_led_scene(uint8_t addr, uint8_t slot, uint8_t op)
+{
+    uint8_t d[2] = {slot, op};
+
+    return v2s_i2c_write_reg16(addr, 0x803f, d, sizeof(d));
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t v2s_led_read_u32(uint8_t addr, uint16_t reg)
+{
+    uint8_t d[4] = {0};
+    v2s_i2c_read_reg16(addr, reg, d, 4);
+    return d[0] | d[1] << 8 | d[2] << 16 | (uint32_t)d[3] << 24;
+}
+
+// device tick(register 0x8044) is taken when the read starts, host time is
+// the middle of the transfer. the sample of shortest transfer of n is kept.
+static double v2s_led_tick(uint8_t addr, int n, uint32_t *tick)
+{
+    double best = 1e9, host = 0;
+
+    for (int i = 0; i < n; i++) {
+        double t0 = now();
+        uint32_t t = v2s_led_read_u32(addr, 0x8044);
+        double t1 = now();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+            host = (t0 + t1) / 2;
+            *tick = t;
+        }
+    }
+    return host;
+}
+
+// clock sync: device tick at host time t is tick0 + (t - host0) x rate,
+// rate is measured over ms and covers drift of both clocks.
+void v2s_led_clock_sync(uint8_t addr, int ms, double *host0, uint32_t *tick0,
+                        double *rate)
+{
+    uint32_t tick1;
+    double host1;
+
+    *host0 = v2s_led_tick(addr, 8, tick0);
+    usleep(ms * 1000);
+    host1 = v2s_led_tick(addr, 8, &tick1);
+    *rate = (uint32_t)(tick1 - *tick0) / (host1 - *host0);
+}
+
+// show the frame written in latch mode when device tick reaches pts.
+int v2s_led_present_at(uint8_t addr, uint32_t pts)
+{
+    uint8_t d[4] = {pts & 0xff, pts >> 8, pts >> 16, pts >> 24};
+    uint8_t commit = 3;
+
+    v2s_i2c_write_reg16(addr, 0x8048, d, sizeof(d));
+    return v2s_i2c_write_reg16(addr, 0x801e, &commit, 1);
+}
+
+// write full frames and report throughput, both measured by host and data
+// bytes counted by device(register 0x800c), device also reports bytes
+// received in last second(register 0x8010).
+void v2s_led_throughput(uint8_t addr, uint16_t leds, int frames)
+{
+    uint8_t d[leds * 3];
+    uint32_t before, after;
+    double t;
+
+    memset(d, 0, sizeof(d));
+
+    before = v2s_led_read_u32(addr, 0x800c);
+    t = now();
+    for (int i = 0; i < frames; i++)
+        v2s_i2c_write_reg16s(addr, 0, d, sizeof(d));
+    t = now() - t;
+    after = v2s_led_read_u32(addr, 0x800c);
+
+    printf("throughput: %d frames of %d LEDs in %.3fs, %.1f frames/s\n",
+           frames, leds, t, frames / t);
+    printf("host: %.0f bytes/s, device: %u bytes received, %.0f bytes/s, "
+           "last second %u bytes/s\n", frames * sizeof(d) / t,
+           after - before, (after - before) / t, v2s_led_read_u32(addr, 0x8010));
 }
 
 int v2s_i2c_read_reg8(uint8_t addr, uint8_t reg, uint8_t *d, uint8_t size)
@@ -166,6 +498,46 @@ int v2s_i2c_write_reg8_byte(uint8_t addr, uint8_t reg, uint8_t d)
     return v2s_i2c_write_reg8(addr, reg, &d, 1);
 }
 
+// general call address 0x00, byte 0x08 commits frames of every controller
+// in latch mode.
+int v2s_led_present_all(void)
+{
+    uint8_t d = 0;
+
+    return v2s_i2c_write_reg8(0x00, 0x08, &d, 0);
+}
+
+// set I2C address and group address(0 for none) of controller at addr,
+// they are saved to flash, controller answers the new address after it.
+int v2s_led_set_address(uint8_t addr, uint8_t new_addr, uint8_t group)
+{
+    uint8_t d[3] = {new_addr, group, 0xa5};
+
+    return v2s_i2c_write_reg16(addr, 0x801f, d, sizeof(d));
+}
+
+// set color order(0 GRB, 1 RGB, 2 BRG, 3 RBG, 4 GBR, 5 BGR) and LED count
+// (0 for all), and save them to config block with the other config.
+int v2s_led_config(uint8_t addr, uint8_t order, uint16_t count)
+{
+    uint8_t d[3] = {order, count & 0xff, count >> 8};
+    uint8_t save = 0xa5;
+
+    v2s_i2c_write_reg16(addr, 0x8041, d, sizeof(d));
+    return v2s_i2c_write_reg16(addr, 0x8021, &save, 1);
+}
+
+// IS31FL3731 auto play, frames from start frame, loops(0 endless) and frame
+// delay in 11ms, frames are written to pages before.
+int v2s_is31_auto_play(uint8_t addr, uint8_t start, uint8_t frames,
+                       uint8_t loops, uint8_t delay)
+{
+    v2s_i2c_write_reg8_byte(addr, 0xfd, 0x0b);
+    v2s_i2c_write_reg8_byte(addr, 0x02, (loops & 0x07) << 4 | (frames & 0x07));
+    v2s_i2c_write_reg8_byte(addr, 0x03, delay & 0x3f);
+    return v2s_i2c_write_reg8_byte(addr, 0x00, 0x08 | (start & 0x07));
+}
+
 int get_screen(libusb_device_handle *h)
 {
     unsigned char buf[5] = {0x51, 0x02, 0x04, 0x1f, 0xfc};
@@ -473,6 +845,8 @@ int main(int argc, char *argv[])
         usleep(10000);
     }
 
+    v2s_led_throughput(0x74, MAX_RGB_LED, 100);
+
 #endif
 
 end: